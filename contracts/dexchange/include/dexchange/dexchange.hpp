@@ -5,6 +5,11 @@
 #include <eosio/asset.hpp>
 #include <eosio/eosio.hpp>
 #include <eosio/singleton.hpp>
+#include <eosio/crypto.hpp>
+#include <eosio/binary_extension.hpp>
+
+#include <dexchange/price.hpp>
+#include <dexchange/engine.hpp>
 
 #include <string>
 #include <cmath>
@@ -14,6 +19,8 @@ using namespace eosio;
 #define MIN_FEE_AMOUNT 10
 #define GL_PERCENT 10
 #define SIG_PERCENT 90
+#define ROLLUP_ON_ORDER 4 // finest candles an order rolls up when it opens a new one
+#define FILL_EVENT_VERSION 2
 #define gl_fee_account "glexchange"
 #define sig_fee_account "sigexchange"
 
@@ -25,21 +32,91 @@ struct token_transfer
       std::string memo;
    };
 
+   enum ORDER_TYPE {
+      ORDER_LIMIT,      // matches and rests what is left
+      ORDER_POST_ONLY,  // rests without matching, fails if it would take
+      ORDER_IOC,        // matches and cancels what is left, never rests
+      ORDER_FOK         // matches in full or fails, never rests
+   };
+
+   struct order_spec {
+      asset sell;
+      asset buy;
+      uint8_t type; // ORDER_TYPE
+   };
+
+   // one fill, sent by matching as the fillevent action. fields are only appended,
+   // a change of their meaning increases FILL_EVENT_VERSION
+   struct Fill_event {
+      uint8_t     version;
+      uint64_t    pair_key;
+      uint64_t    maker_id;
+      uint64_t    taker_id;
+      eosio::name maker;
+      eosio::name taker;
+      uint8_t     taker_side;
+      uint64_t    ticks;      // deal price is ticks * tick_size / PRICE_SCALE, the product may not fit into 64 bits
+      uint64_t    tick_size;
+      asset       base;       // of the pair sell token
+      asset       quote;      // of the pair buy token
+      asset       maker_fee;
+      asset       taker_fee;
+   };
+
    struct token_info {
       eosio::asset available;
       eosio::asset used;
    };
 
-   struct [[eosio::table, eosio::contract("dexchange")]] Account {
+   // balance of one token of an account, scope is the token symbol code
+   struct [[eosio::table, eosio::contract("dexchange")]] Balance {
+      eosio::name    owner;
+      int64_t        available;
+      int64_t        used;        // locked in open orders
+
+      uint64_t primary_key()const { return owner.value; }
+   };
+
+   using balance_index = multi_index<"balances"_n, Balance>;
+
+   // balances changed by an action. every row is read once and written once by flush,
+   // however many fills touch it. the contract flushes before it returns from an action
+   class Balance_cache {
+      public:
+         Balance_cache(const name& self);
+         Balance_cache(const Balance_cache&) = delete;
+
+         void lock(const name& owner, const asset& quantity);
+         void debit_used(const name& owner, const asset& quantity);
+         void unlock(const name& owner, const asset& quantity);
+         void credit(const name& owner, const asset& quantity);
+         void flush();
+
+      private:
+         struct Cached_balance {
+            Balance  balance;
+            bool     exists;   // the row is in the table
+            bool     dirty;
+         };
+
+         Cached_balance& row(const name& owner, const symbol& s);
+         balance_index& table(const uint64_t code);
+
+         name self;
+         std::map<std::pair<uint64_t, uint64_t>, Cached_balance> rows; // token code, owner
+         std::map<uint64_t, balance_index> tables;
+   };
+
+   // account with all its balances in one row, only read by migrateaccts
+   struct [[eosio::table, eosio::contract("dexchange")]] Legacy_account {
       eosio::name    owner;
       uint64_t       key;
       std::map<symbol, token_info> balances;
-      std::map<std::pair<symbol, symbol>, uint64_t>   pairs_keys;
 
       uint64_t primary_key()const { return owner.value; }
    };
 
-   using account_index = multi_index<"accounts"_n, Account>;
+   using legacy_account_index = multi_index<"accounts"_n, Legacy_account>;
 
    struct [[eosio::table, eosio::contract("dexchange")]] BlackList {
       eosio::name    account;
@@ -50,6 +127,34 @@ struct token_transfer
 
    using blacklist_index = multi_index<"blacklist"_n, BlackList>;
 
+   // accounts whose fills are credited to their exchange balance instead of being transferred out
+   struct [[eosio::table, eosio::contract("dexchange")]] Settlement {
+      eosio::name    account;
+
+      uint64_t primary_key()const { return account.value; }
+   };
+
+   using settlement_index = multi_index<"settlement"_n, Settlement>;
+
+   // fees collected and not paid to the fee accounts yet, one row per token
+   struct [[eosio::table, eosio::contract("dexchange")]] Fee_ledger {
+      asset    amount;
+
+      uint64_t primary_key()const { return amount.symbol.code().raw(); }
+   };
+
+   using fees_index = multi_index<"fees"_n, Fee_ledger>;
+
+   // symbols of a pair in a fixed order, so both directions give the same value
+   inline uint128_t pair_symbols(const symbol& a, const symbol& b) {
+      return a.raw() < b.raw() ? (uint128_t(a.raw()) << 64) | b.raw() : (uint128_t(b.raw()) << 64) | a.raw();
+   }
+
+   inline checksum256 pair_owner_key(const symbol& a, const symbol& b, const name& owner) {
+      uint128_t pair = pair_symbols(a, b);
+      return checksum256::make_from_word_sequence<uint64_t>(uint64_t(pair >> 64), uint64_t(pair), owner.value, 0ULL);
+   }
+
    struct [[eosio::table, eosio::contract("dexchange")]] Order {
       uint64_t       total_id;
       eosio::name    owner;
@@ -64,13 +169,12 @@ struct token_transfer
       asset          fee;
       double         average_price;
 
-      uint64_t primary_key()const { return start_time.elapsed.count()^total_id; } // unique
-      uint64_t by_id() const { return total_id; }
-      uint64_t by_time() const { return start_time.elapsed.count(); }
-      double   by_price() const { return price; }
-      uint64_t by_owner() const { return owner.value; }
-      uint64_t by_pair() const { return buy.symbol.raw()^sell.symbol.raw(); }
-      uint64_t by_pair_owner() const { return buy.symbol.raw()^sell.symbol.raw()^owner.value; }
+      uint64_t    primary_key()const { return total_id; }
+      uint64_t    by_time() const { return start_time.elapsed.count(); }
+      double      by_price() const { return price; }
+      uint64_t    by_owner() const { return owner.value; }
+      uint128_t   by_pair() const { return pair_symbols(sell.symbol, buy.symbol); }
+      checksum256 by_pair_owner() const { return pair_owner_key(sell.symbol, buy.symbol, owner); }
 
       uint64_t by_value() const { return buy.amount; }
       uint64_t sell_left_value() const { return sell.amount - paid.amount; }
@@ -78,25 +182,108 @@ struct token_transfer
       void     update_average_price(const asset& r, const asset& p, const asset& fee, bool convert);
    };
 
-   using info_orders_index = multi_index< "ordersinfo"_n, Order,
-                           indexed_by<"bypair"_n, const_mem_fun< Order, uint64_t, &Order::by_pair>>,
+   using info_orders_index = multi_index< "openorders"_n, Order,
+                           indexed_by<"bypair"_n, const_mem_fun< Order, uint128_t, &Order::by_pair>>,
                            indexed_by<"byowner"_n, const_mem_fun< Order, uint64_t, &Order::by_owner>>,
-                           indexed_by<"bypairowner"_n, const_mem_fun< Order, uint64_t, &Order::by_pair_owner>>,
-                           indexed_by<"byid"_n, const_mem_fun< Order, uint64_t, &Order::by_id>>,
+                           indexed_by<"bypairowner"_n, const_mem_fun< Order, checksum256, &Order::by_pair_owner>>,
                            indexed_by<"byordersize"_n, const_mem_fun< Order, uint64_t, &Order::sell_left_value>>
                               >;
 
+   // order info keyed by start_time ^ total_id, only read by migratekeys
+   struct [[eosio::table, eosio::contract("dexchange")]] Legacy_order {
+      uint64_t       total_id;
+      eosio::name    owner;
+      double         price;
+      time_point     start_time;
+      asset          sell;
+      asset          buy;
+
+      asset          received;
+      asset          paid;
+
+      asset          fee;
+      double         average_price;
+
+      uint64_t primary_key()const { return start_time.elapsed.count()^total_id; }
+      uint64_t by_id() const { return total_id; }
+      uint64_t by_owner() const { return owner.value; }
+      uint64_t by_pair() const { return buy.symbol.raw()^sell.symbol.raw(); }
+      uint64_t by_pair_owner() const { return buy.symbol.raw()^sell.symbol.raw()^owner.value; }
+      uint64_t sell_left_value() const { return sell.amount - paid.amount; }
+   };
+
+   using legacy_orders_info_index = multi_index< "ordersinfo"_n, Legacy_order,
+                           indexed_by<"bypair"_n, const_mem_fun< Legacy_order, uint64_t, &Legacy_order::by_pair>>,
+                           indexed_by<"byowner"_n, const_mem_fun< Legacy_order, uint64_t, &Legacy_order::by_owner>>,
+                           indexed_by<"bypairowner"_n, const_mem_fun< Legacy_order, uint64_t, &Legacy_order::by_pair_owner>>,
+                           indexed_by<"byid"_n, const_mem_fun< Legacy_order, uint64_t, &Legacy_order::by_id>>,
+                           indexed_by<"byordersize"_n, const_mem_fun< Legacy_order, uint64_t, &Legacy_order::sell_left_value>>
+                              >;
+
+   // legacy order book, one row per pair; only read by migratebook
    struct [[eosio::table, eosio::contract("dexchange")]] Orders {
       symbol sell;
       symbol buy;
       std::list<Order> sell_orders;
       std::list<Order> buy_orders;
       uint64_t primary_key()const { return buy.raw()^sell.raw(); }
-      void insert_order(Order& o);
    };
 
    using orders_index = multi_index< "orders"_n, Orders>;
 
+   // resting order, one row per order, scope is the pair key
+   struct [[eosio::table, eosio::contract("dexchange")]] Book_order {
+      uint64_t       total_id;
+      uint8_t        side;
+      eosio::name    owner;
+      uint64_t       ticks;
+      time_point     start_time;
+      asset          sell;
+      asset          buy;
+      asset          paid;
+
+      uint64_t    primary_key()const { return total_id; }
+      checksum256 by_price() const; // side, price, time, id. best order of each side first
+      asset       sell_left() const { return sell - paid; }
+   };
+
+   using book_index = multi_index< "book"_n, Book_order,
+                           indexed_by<"byprice"_n, const_mem_fun< Book_order, checksum256, &Book_order::by_price>>
+                           >;
+
+   // price-time priority order book of one pair. the best order of each side is
+   // cached for the lifetime of the object, an order is removed through its iterator.
+   // SIDE_PENDING rows are takers waiting for crank, after both sides in time order
+   class Order_book {
+      public:
+         using price_index = decltype(std::declval<book_index>().get_index<"byprice"_n>());
+         using const_iterator = price_index::const_iterator;
+
+         Order_book(const name& self, const uint64_t pair_key);
+         Order_book(const Order_book&) = delete;
+
+         const_iterator best(const uint8_t side);
+         const_iterator begin() const { return index.begin(); }
+         const_iterator end() const { return index.end(); }
+         const_iterator find(const uint64_t total_id) const;
+         const_iterator first_pending() const;
+         bool empty() const { return book.begin() == book.end(); }
+
+         void insert(const Order& o, const uint8_t side, const uint64_t ticks);
+         void update(const_iterator itr, const asset& paid);
+         void amend(const_iterator itr, const asset& sell, const asset& buy);
+         const_iterator erase(const_iterator itr);
+
+      private:
+         std::optional<const_iterator>& cached_best(const uint8_t side) { return side == SIDE_SELL ? best_sell : best_buy; }
+
+         name self;
+         book_index book;
+         price_index index;
+         std::optional<const_iterator> best_sell;
+         std::optional<const_iterator> best_buy;
+   };
+
    enum ORDER_CLOSED_STATUS {
       CLOSED_NORMALLY,
       CLOSED_BY_USER,
@@ -104,7 +291,8 @@ struct token_transfer
       CLOSED_TOKEN_DELETED,
       CLOSED_TOKEN_PAIR_DELETED,
       CLOSED_ACCOUNT_BLACKLISTED,
-      CLOSED_BY_MINIMUM_ORDER_SIZE
+      CLOSED_BY_MINIMUM_ORDER_SIZE,
+      CLOSED_NOT_FILLED_IMMEDIATELY
    };
 
    const std::vector<std::string> memos = {
@@ -114,7 +302,8 @@ struct token_transfer
    "This token has been removed from the exchange",
    "This token pair has been removed from the exchange",
    "This account has been blacklisted",
-   "The order amount does not meet the requirements of the exchange."
+   "The order amount does not meet the requirements of the exchange.",
+   "The rest of an immediate-or-cancel order has been canceled"
    };
 
    struct [[eosio::table, eosio::contract("dexchange")]] History {
@@ -130,7 +319,51 @@ struct token_transfer
       asset          fee;
       double         price;
       double         average_price;
-      uint64_t primary_key()const { return start_time.elapsed.count() ^ total_id; } // unique
+      uint64_t    primary_key()const { return total_id; }
+      uint128_t   by_pair()const { return pair_symbols(sell.symbol, buy.symbol); }
+      uint64_t    by_owner()const { return owner.value; }
+      checksum256 by_pair_owner() const { return pair_owner_key(sell.symbol, buy.symbol, owner); }
+      uint64_t    by_end_time() const { return end_time.elapsed.count(); }
+      uint128_t   by_end_time_owner() const { return (uint128_t(owner.value) << 64) | uint64_t(end_time.elapsed.count()); } // owner, then end time
+   };
+
+   using orders_history_index = multi_index< "orderhist"_n, History, 
+                                 indexed_by<"bypair"_n, const_mem_fun< History, uint128_t, &History::by_pair>>,
+                                 indexed_by<"byowner"_n, const_mem_fun< History, uint64_t, &History::by_owner>>,
+                                 indexed_by<"bypairowner"_n, const_mem_fun< History, checksum256, &History::by_pair_owner>>,
+                                 indexed_by<"byendtime"_n, const_mem_fun< History, uint64_t, &History::by_end_time>>,
+                                 indexed_by<"byendtowner"_n, const_mem_fun< History, uint128_t, &History::by_end_time_owner>>
+                                 >;
+
+   // closed orders of an owner in orderhist. prunehist counts the rows of an owner once from
+   // the cursor on, after that the count is kept by every write of the history
+   struct [[eosio::table, eosio::contract("dexchange")]] History_count {
+      eosio::name    owner;
+      uint64_t       entries = 0;
+      bool           counted = false;
+      uint128_t      cursor = 0;      // by_end_time_owner of the last counted row
+      uint32_t       at_cursor = 0;   // rows counted with that key, end times of one action are equal
+
+      uint64_t primary_key() const { return owner.value; }
+   };
+
+   using history_count_index = multi_index< "histcount"_n, History_count>;
+
+   // history keyed by start_time ^ total_id, only read by migratekeys
+   struct [[eosio::table, eosio::contract("dexchange")]] Legacy_history {
+      uint64_t       total_id;
+      uint8_t        close_status = 0;
+      eosio::name    owner;
+      time_point     start_time;
+      time_point     end_time;
+      asset          sell;
+      asset          buy;
+      asset          received;
+      asset          paid;
+      asset          fee;
+      double         price;
+      double         average_price;
+      uint64_t primary_key()const { return start_time.elapsed.count() ^ total_id; }
       uint64_t by_pair()const { return received.symbol.raw()^paid.symbol.raw(); }
       uint64_t by_owner()const { return owner.value; }
       uint64_t by_pair_owner() const { return received.symbol.raw()^paid.symbol.raw()^owner.value; }
@@ -138,15 +371,65 @@ struct token_transfer
       uint64_t by_end_time_owner() const { return end_time.elapsed.count()^owner.value; }
    };
 
-   using orders_history_index = multi_index< "history"_n, History, 
-                                 indexed_by<"bypair"_n, const_mem_fun< History, uint64_t, &History::by_pair>>,
-                                 indexed_by<"byowner"_n, const_mem_fun< History, uint64_t, &History::by_owner>>,
-                                 indexed_by<"bypairowner"_n, const_mem_fun< History, uint64_t, &History::by_pair_owner>>,
-                                 indexed_by<"byendtime"_n, const_mem_fun< History, uint64_t, &History::by_end_time>>,
-                                 indexed_by<"byendtowner"_n, const_mem_fun< History, uint64_t, &History::by_end_time_owner>>
+   using legacy_history_index = multi_index< "history"_n, Legacy_history,
+                                 indexed_by<"bypair"_n, const_mem_fun< Legacy_history, uint64_t, &Legacy_history::by_pair>>,
+                                 indexed_by<"byowner"_n, const_mem_fun< Legacy_history, uint64_t, &Legacy_history::by_owner>>,
+                                 indexed_by<"bypairowner"_n, const_mem_fun< Legacy_history, uint64_t, &Legacy_history::by_pair_owner>>,
+                                 indexed_by<"byendtime"_n, const_mem_fun< Legacy_history, uint64_t, &Legacy_history::by_end_time>>,
+                                 indexed_by<"byendtowner"_n, const_mem_fun< Legacy_history, uint64_t, &Legacy_history::by_end_time_owner>>
                                  >;
 
+   // candle of one interval, scope is the pair key
    struct [[eosio::table, eosio::contract("dexchange")]] Bucket {
+      uint64_t          bucket;
+      time_point_sec    open;
+      symbol            base;
+      symbol            quote;
+      double            high_base;
+      double            low_base;
+      double            open_base;
+      double            close_base;
+      double            base_volume;
+      double            quote_volume;
+
+      uint64_t    primary_key()const { return candle_key(bucket, open); }
+
+      static uint64_t candle_key(const uint64_t bucket, const time_point_sec& open) { return (bucket << 32) | open.sec_since_epoch(); }
+      void update(const asset& sell, const asset& buy, double price);
+      void merge(const Bucket& b); // b is the later part of the candle
+   };
+
+   using bucket_index = multi_index< "candles"_n, Bucket>;
+
+   // collects the fills of one order and writes each configured candle once. all fills
+   // of an action have the same block time, so they fall into one candle per interval
+   class Candle_aggregator {
+      public:
+         Candle_aggregator(const name& self, const uint64_t pair_key);
+         Candle_aggregator(const Candle_aggregator&) = delete;
+
+         void add(const asset& sell, const asset& buy, const double price);
+         bool flush(const std::vector<uint32_t>& intervals, const bool finest_only);
+         uint32_t roll_up(const std::vector<uint32_t>& intervals, uint32_t& rolled_until, const uint32_t until, const uint32_t max_candles);
+
+      private:
+         name self;
+         bucket_index candles;
+         std::optional<Bucket> fills; // fills since the last flush
+   };
+
+   // finest candles of the pair opened before rolled_until are rolled up into the coarser intervals
+   struct [[eosio::table, eosio::contract("dexchange")]] Rollup_state {
+      uint64_t pair_key;
+      uint32_t rolled_until;
+
+      uint64_t primary_key()const { return pair_key; }
+   };
+
+   using rollup_index = multi_index< "rollups"_n, Rollup_state>;
+
+   // candles kept in one table per interval, only read by migratekeys
+   struct [[eosio::table, eosio::contract("dexchange")]] Legacy_bucket {
       uint64_t          id;
       uint64_t          bucket;
       time_point_sec    open;
@@ -162,44 +445,87 @@ struct token_transfer
       uint64_t    primary_key()const { return id; }
       uint64_t    by_pair()const { return base.raw()^quote.raw(); }
       uint64_t    by_pair_time()const { return base.raw()^quote.raw()^open.sec_since_epoch(); }
-
-      void update(asset& sell, asset& buy, double price);
    };
 
-   using bucket_index1 = multi_index< "b1minute"_n, Bucket,
-                           indexed_by<"bypair"_n, const_mem_fun< Bucket, uint64_t, &Bucket::by_pair>>, 
-                           indexed_by<"bypairtime"_n, const_mem_fun< Bucket, uint64_t, &Bucket::by_pair_time>>
+   using legacy_bucket_index1 = multi_index< "b1minute"_n, Legacy_bucket,
+                           indexed_by<"bypair"_n, const_mem_fun< Legacy_bucket, uint64_t, &Legacy_bucket::by_pair>>, 
+                           indexed_by<"bypairtime"_n, const_mem_fun< Legacy_bucket, uint64_t, &Legacy_bucket::by_pair_time>>
                            >;
-   using bucket_index2 = multi_index< "b5minutes"_n, Bucket,
-                           indexed_by<"bypair"_n, const_mem_fun< Bucket, uint64_t, &Bucket::by_pair>>, 
-                           indexed_by<"bypairtime"_n, const_mem_fun< Bucket, uint64_t, &Bucket::by_pair_time>>
+   using legacy_bucket_index2 = multi_index< "b5minutes"_n, Legacy_bucket,
+                           indexed_by<"bypair"_n, const_mem_fun< Legacy_bucket, uint64_t, &Legacy_bucket::by_pair>>, 
+                           indexed_by<"bypairtime"_n, const_mem_fun< Legacy_bucket, uint64_t, &Legacy_bucket::by_pair_time>>
                            >;
-   using bucket_index3 = multi_index< "b15minutes"_n, Bucket,
-                           indexed_by<"bypair"_n, const_mem_fun< Bucket, uint64_t, &Bucket::by_pair>>, 
-                           indexed_by<"bypairtime"_n, const_mem_fun< Bucket, uint64_t, &Bucket::by_pair_time>>
+   using legacy_bucket_index3 = multi_index< "b15minutes"_n, Legacy_bucket,
+                           indexed_by<"bypair"_n, const_mem_fun< Legacy_bucket, uint64_t, &Legacy_bucket::by_pair>>, 
+                           indexed_by<"bypairtime"_n, const_mem_fun< Legacy_bucket, uint64_t, &Legacy_bucket::by_pair_time>>
                            >;
-   using bucket_index4 = multi_index< "bhalfhour"_n, Bucket,
-                           indexed_by<"bypair"_n, const_mem_fun< Bucket, uint64_t, &Bucket::by_pair>>, 
-                           indexed_by<"bypairtime"_n, const_mem_fun< Bucket, uint64_t, &Bucket::by_pair_time>>
+   using legacy_bucket_index4 = multi_index< "bhalfhour"_n, Legacy_bucket,
+                           indexed_by<"bypair"_n, const_mem_fun< Legacy_bucket, uint64_t, &Legacy_bucket::by_pair>>, 
+                           indexed_by<"bypairtime"_n, const_mem_fun< Legacy_bucket, uint64_t, &Legacy_bucket::by_pair_time>>
                            >;
-   using bucket_index5 = multi_index< "b1hour"_n, Bucket,
-                           indexed_by<"bypair"_n, const_mem_fun< Bucket, uint64_t, &Bucket::by_pair>>, 
-                           indexed_by<"bypairtime"_n, const_mem_fun< Bucket, uint64_t, &Bucket::by_pair_time>>
+   using legacy_bucket_index5 = multi_index< "b1hour"_n, Legacy_bucket,
+                           indexed_by<"bypair"_n, const_mem_fun< Legacy_bucket, uint64_t, &Legacy_bucket::by_pair>>, 
+                           indexed_by<"bypairtime"_n, const_mem_fun< Legacy_bucket, uint64_t, &Legacy_bucket::by_pair_time>>
                            >;
-   using bucket_index6 = multi_index< "b4hours"_n, Bucket,
-                           indexed_by<"bypair"_n, const_mem_fun< Bucket, uint64_t, &Bucket::by_pair>>, 
-                           indexed_by<"bypairtime"_n, const_mem_fun< Bucket, uint64_t, &Bucket::by_pair_time>>
+   using legacy_bucket_index6 = multi_index< "b4hours"_n, Legacy_bucket,
+                           indexed_by<"bypair"_n, const_mem_fun< Legacy_bucket, uint64_t, &Legacy_bucket::by_pair>>, 
+                           indexed_by<"bypairtime"_n, const_mem_fun< Legacy_bucket, uint64_t, &Legacy_bucket::by_pair_time>>
                            >;
-   using bucket_index7 = multi_index< "b24hours"_n, Bucket,
-                           indexed_by<"bypair"_n, const_mem_fun< Bucket, uint64_t, &Bucket::by_pair>>, 
-                           indexed_by<"bypairtime"_n, const_mem_fun< Bucket, uint64_t, &Bucket::by_pair_time>>
+   using legacy_bucket_index7 = multi_index< "b24hours"_n, Legacy_bucket,
+                           indexed_by<"bypair"_n, const_mem_fun< Legacy_bucket, uint64_t, &Legacy_bucket::by_pair>>, 
+                           indexed_by<"bypairtime"_n, const_mem_fun< Legacy_bucket, uint64_t, &Legacy_bucket::by_pair_time>>
                            >;
 
-   struct Pair_info {
+   // listed pair. the key is unique and is the scope of the pair order book
+   struct [[eosio::table, eosio::contract("dexchange")]] Pair_info {
+      uint64_t key;
       symbol   sell;
       symbol   buy;
-      uint64_t key;
+      uint64_t tick_size = DEFAULT_TICK_SIZE;
+
+      uint64_t  primary_key()const { return key; }
+      uint128_t by_symbols()const { return pair_symbols(sell, buy); }
+   };
 
+   using pairs_index = multi_index< "pairs"_n, Pair_info,
+                           indexed_by<"bysymbols"_n, const_mem_fun< Pair_info, uint128_t, &Pair_info::by_symbols>>
+                           >;
+
+   enum JOB_TYPE {
+      JOB_DROP_BY_TOKEN,
+      JOB_DELETE_TOKEN,
+      JOB_STOP_ROLLUP,    // blocks every pair
+      JOB_DROP_BY_PAIR,
+      JOB_DELETE_PAIR
+   };
+
+   enum JOB_STAGE {
+      STAGE_CANCEL_ORDERS,
+      STAGE_RETURN_TOKENS,
+      STAGE_ROLLUP_CANDLES,
+      STAGE_CLEAR_ROLLUPS
+   };
+
+   // administrating operation over all orders or accounts, done in slices by continuejob
+   struct [[eosio::table, eosio::contract("dexchange")]] Job {
+      uint64_t id;
+      uint8_t  type;
+      uint8_t  stage;
+      name     contract;   // token contract of JOB_DELETE_TOKEN
+      symbol   token;      // token of JOB_DROP_BY_TOKEN and JOB_DELETE_TOKEN
+      uint64_t cursor;     // pair the cancel and roll up stages continue from, the pair of JOB_DROP_BY_PAIR and JOB_DELETE_PAIR
+
+      uint64_t primary_key()const { return id; }
+      bool     blocks(const Pair_info& pair) const; // orders on the pair wait for the job
+   };
+
+   using jobs_index = multi_index< "jobs"_n, Job>;
+
+   // pair as it was kept in globalstate, only read by migratepairs
+   struct Legacy_pair_info {
+      symbol   sell;
+      symbol   buy;
+      uint64_t key;
    };
 
    struct Symbols {
@@ -212,41 +538,51 @@ struct token_transfer
       asset    min_order;
    };
 
+   // cold exchange configuration, written by administrating actions only
    struct [[eosio::table, eosio::contract("dexchange")]] globalstate {
-      uint64_t                               total_order_id = 0;
+      uint64_t                               total_order_id = 0; // obsolete, seeds counterstate once
       std::map<eosio::name, Symbols>         token_contracts;
       std::map<eosio::symbol, eosio::name>   permitted_tokens;
-      std::list<Pair_info>                   permitted_pairs;
+      std::list<Legacy_pair_info>            permitted_pairs; // obsolete, moved to the pairs table by migratepairs
       std::map<symbol, Fee_info>             fee;
-      std::vector<uint32_t>                  buckets = {60, 300, 900, 1800, 3600, 14400, 86400};
+      std::vector<uint32_t>                  buckets = {60, 300, 900, 1800, 3600, 14400, 86400}; // candle intervals in seconds, sorted
+      binary_extension<uint32_t>             rollup_since; // orders write only the finest candles from this time, 0 - all of them
+      binary_extension<uint32_t>             history_entries; // closed orders prunehist keeps per owner, 0 - no limit
+      binary_extension<uint32_t>             history_days;    // days prunehist keeps closed orders, 0 - no limit
+      binary_extension<uint32_t>             max_fills;       // fills of one action, the rest of a taker waits for crank, 0 - no limit
 
-      std::optional<Pair_info> pair_permitted(const asset& a, const asset& b) const;
       bool token_permitted(const asset& a) const;
+      bool rollup_active(const uint32_t now) const { return rollup_since.value_or(0) != 0 && now >= rollup_since.value_or(0); }
    };
 
    using  global_state_singleton = singleton<"globalstate"_n, globalstate>;
 
+   // hot state written by every order, also read by every order instead of scanning tables
+   struct [[eosio::table, eosio::contract("dexchange")]] counterstate {
+      uint64_t                               total_order_id = 0;
+      binary_extension<uint32_t>             job_count; // rows of jobs, counted from the table once
+      binary_extension<bool>                 migrated;  // no legacy table has rows left, see check_pair_migrated
+   };
+
+   using  counter_state_singleton = singleton<"counters"_n, counterstate>;
+
    class [[eosio::contract("dexchange")]] dexchange : public contract {
       public:
          using contract::contract;
 
       dexchange( name s, name code, datastream<const char*> ds ):contract(s, code, ds),
          global(_self, _self.value),
-         accounts(get_self(), get_self().value),
+         counter(_self, _self.value),
+         pairs(_self, _self.value),
          blacklist(get_self(), get_self().value),
+         settlement(get_self(), get_self().value),
+         jobs(get_self(), get_self().value),
+         balance_cache(get_self()),
+         fees(get_self(), get_self().value),
          all_orders(get_self(), get_self().value),
          all_orders_info(get_self(), get_self().value),
-         orders_history(get_self(), get_self().value),
-         buckets1(get_self(), get_self().value),
-         buckets2(get_self(), get_self().value),
-         buckets3(get_self(), get_self().value),
-         buckets4(get_self(), get_self().value),
-         buckets5(get_self(), get_self().value),
-         buckets6(get_self(), get_self().value),
-         buckets7(get_self(), get_self().value)
+         orders_history(get_self(), get_self().value)
       {
-         if(global.exists())
-            gstate = global.get();
       }
 
       [[eosio::action]]
@@ -260,6 +596,15 @@ struct token_transfer
                   const asset&   sell,
                   const asset&   bye);
       
+      [[eosio::action]]
+      void placeorder( const name& owner, const asset& sell, const asset& buy, const uint8_t type);
+
+      [[eosio::action]]
+      void placebatch( const name& owner, const std::vector<order_spec>& orders);
+
+      [[eosio::action]]
+      void amend( const name& owner, const uint64_t order_id, const asset& new_sell, const asset& new_buy);
+
       [[eosio::action]]
       void dropall( const name& owner);
 
@@ -270,6 +615,19 @@ struct token_transfer
       void withdraw( const name&    owner, 
                      const symbol&  token);
 
+      [[eosio::action]]
+      void setsettle( const name& owner, const bool internal);
+
+      [[eosio::action]]
+      void claimfees();
+
+      [[eosio::action]]
+      void continuejob(const uint32_t max_rows);
+
+      // matches takers stopped by the fill limit, anyone may push it
+      [[eosio::action]]
+      void crank(const symbol& a, const symbol& b, const uint32_t max_fills);
+
       // administrating
       [[eosio::action]]
       void init();
@@ -301,39 +659,119 @@ struct token_transfer
       [[eosio::action]]
       void delblacklist(const name& account);
 
+      [[eosio::action]]
+      void addbucket(const uint32_t interval);
+
+      [[eosio::action]]
+      void delbucket(const uint32_t interval);
+
+      [[eosio::action]]
+      void setrollup(const bool enabled);
+
+      [[eosio::action]]
+      void rollup(const symbol& a, const symbol& b, const uint32_t max_candles);
+
+      [[eosio::action]]
+      void settick(const symbol& a, const symbol& b, const uint64_t tick_size);
+
+      [[eosio::action]]
+      void sethistory(const uint32_t max_entries, const uint32_t max_days);
+
+      [[eosio::action]]
+      void prunehist(const name& owner, const uint32_t max_rows);
+
+      [[eosio::action]]
+      void setmaxfills(const uint32_t max_fills);
+
+      // the record of a closed order for off-chain consumers, sent by the contract only
+      [[eosio::action]]
+      void histlog(const History& h);
+
+      // a fill for off-chain consumers, sent by the contract only
+      [[eosio::action]]
+      void fillevent(const Fill_event& e);
+
+      [[eosio::action]]
+      void migratebook(const uint32_t max_orders);
+
+      [[eosio::action]]
+      void migratepairs();
+
+      [[eosio::action]]
+      void migratekeys(const uint32_t max_rows);
+
+      [[eosio::action]]
+      void migrateaccts(const uint32_t max_rows);
+
       private:
       
       global_state_singleton global;
-      globalstate gstate;
-      account_index accounts;
+      std::optional<globalstate> config_cache; // loaded on first use, see config()
+      std::optional<counterstate> counter_cache; // loaded on first use, see counters()
+      std::vector<std::pair<symbol, Fee_info>> fee_cache; // config().fee sorted by symbol, see fee_info()
+      std::map<uint128_t, uint64_t> pair_key_cache; // pair symbols to pair key, see pair_key()
+      counter_state_singleton counter;
+      pairs_index   pairs;
       blacklist_index   blacklist;
+      settlement_index  settlement;
+      jobs_index    jobs;
+      Balance_cache balance_cache;
+      fees_index    fees;
       orders_index  all_orders;
       info_orders_index  all_orders_info;
       orders_history_index  orders_history;
-      bucket_index1   buckets1;
-      bucket_index2   buckets2;
-      bucket_index3   buckets3;
-      bucket_index4   buckets4;
-      bucket_index5   buckets5;
-      bucket_index6   buckets6;
-      bucket_index7   buckets7;
-
-      uint64_t get_new_total_order_id();
-      Order init_order( const name& owner, const asset& sell, const asset& buy, const symbol& sell_symbol);
+      uint32_t fills_left = UINT32_MAX; // of the action, see fill_limit()
+
+      globalstate& config();
+      counterstate& counters();
+      void save_counters();
+      uint32_t fill_limit();
+      const Fee_info& fee_info(const symbol& s);
+      std::optional<Pair_info> find_pair(const symbol& a, const symbol& b);
+      uint64_t pair_key(const symbol& a, const symbol& b);
+      uint64_t get_new_total_order_id(const uint64_t count = 1);
+      Order init_order( const uint64_t total_id, const name& owner, const asset& sell, const asset& buy, const symbol& sell_symbol, const uint64_t ticks, const uint64_t tick_size);
+      void place_order(const uint64_t total_id, const name& owner, const asset& sell, const asset& buy, const uint8_t type, const Pair_info& pair, Order_book& book, Candle_aggregator& candles);
+      void post_order(const Pair_info& pair, Order_book& book, const Order& o, const uint64_t ticks);
+      void take_order(const Pair_info& pair, Order_book& book, Candle_aggregator& candles, Order& o, const uint64_t ticks, const uint8_t type);
+      void submit_order(const Pair_info& pair, Order_book& book, Candle_aggregator& candles, Order& o, const uint64_t ticks, const bool has_info);
+      bool run_pending(const Pair_info& pair, Order_book& book, Candle_aggregator& candles);
+      void match_and_rest(const Pair_info& pair, Order_book& book, Candle_aggregator& candles, Order& o, const uint64_t ticks, const bool has_info);
+      void rest_order(Order_book& book, const Order& o, const uint8_t side, const uint64_t ticks, const bool has_info);
+      void flush_candles(const Pair_info& pair, Candle_aggregator& candles);
       void order_to_history(const Order& o, uint8_t close_status);
-      void modify_orders_info(Order& o);
-      void matching(std::list<Order> sell, std::list<Order> buy);
-      void update_buckets(asset& sell, asset& buy, double price);
+      void count_history(const name& owner);
+      Order fill_order(const Book_order& b, const asset& r, const asset& p, const asset& fee, bool convert);
+      uint8_t matching(const Pair_info& pair, Order_book& book, Candle_aggregator& candles, Order& taker, const uint8_t side, const uint64_t ticks);
+      void close_order(const Order& o, const uint16_t reason);
 
-      void drop_orders_common(std::map<uint64_t, std::set<Order>>& orders_by_pairs, std::map< name, std::map<symbol, asset>> assets_to_transfer, const uint16_t reason);
+      void drop_orders_common(const std::map<uint64_t, std::vector<Order>>& orders_by_pairs, const uint16_t reason);
       void dropsmallorders(const symbol& s);
-      void cancel_orders_by_token( const symbol& s, const uint16_t reason);
-      void cancel_orders_by_token_pair( const symbol& a, const symbol& b, const uint16_t reason);
-      void erase_by_pair_orders(const std::map<uint64_t, std::set<Order>>& orders_by_pairs, const uint16_t reason);
+      bool cancel_orders_by_token( const symbol& s, const uint16_t reason, uint64_t& cursor, const uint32_t max_rows, uint32_t& processed);
+      void start_pair_job(const symbol& a, const symbol& b, const uint8_t type);
+      void remove_pair(const uint64_t pair_key);
+      void erase_by_pair_orders(const std::map<uint64_t, std::vector<Order>>& orders_by_pairs, const uint16_t reason,
+                                std::map< name, std::map<symbol, asset>>* assets_to_transfer = nullptr);
       void insert_assets_to_transfer(const Order& order, std::map< name, std::map<symbol, asset>>& assets_to_transfer);
-      void erase_all_pair_orders(const Orders& orders, const uint16_t reason);
+      bool erase_all_pair_orders(const uint64_t pair_key, const uint16_t reason, const uint32_t max_rows, uint32_t& processed);
+      void check_pair_migrated(const uint64_t pair_key);
+      void add_job(Job job);
+      void check_orders_migrated();
+      void check_accounts_migrated();
+      void check_no_job(const Pair_info& pair);
+      bool deleting_token(const symbol& s);
+      bool stopping_rollup();
+      bool stop_rollup(Job& job, const uint32_t max_rows, uint32_t& processed);
+      bool run_job(Job& job, const uint32_t max_rows, uint32_t& processed);
+      void remove_token(const name& contract, const symbol& s);
+      void check_rollup_intervals(const std::vector<uint32_t>& intervals);
+      uint32_t rollup_candles(const uint64_t pair_key, Candle_aggregator& candles, const uint32_t until, const uint32_t max_candles);
+      template<typename T>
+      uint32_t migrate_buckets(T& legacy, uint32_t max_rows);
 
       void send_transfer(const name& to, const asset& quantity, const std::string& memo);
       void send_order_tokens(const eosio::name& from, const eosio::name& to, const eosio::asset& quantity, const eosio::asset& fee);
-      void return_tokens(const eosio::symbol& s);
+      void accrue_fee(const asset& fee);
+      void pay_fees(fees_index::const_iterator itr);
+      bool return_tokens(const eosio::symbol& s, const uint32_t max_rows, uint32_t& processed);
    };
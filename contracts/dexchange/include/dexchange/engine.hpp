@@ -0,0 +1,151 @@
+#pragma once
+
+#include <dexchange/price.hpp>
+
+#include <algorithm>
+#include <cstdint>
+
+// Matching and candle arithmetic without any storage. The contract runs it over its
+// tables, the native build (see native/) over an in-memory book.
+
+enum ORDER_SIDE {
+   SIDE_SELL,    // sells Pair_info::sell
+   SIDE_BUY,     // sells Pair_info::buy
+   SIDE_PENDING  // contract book only, a taker stopped by the fill limit, see crank
+};
+
+enum MAKER_CLOSE {
+   MAKER_FILLED,
+   MAKER_TOO_SMALL
+};
+
+// why match_orders stopped
+enum MATCH_END {
+   MATCH_DONE,        // the taker is filled or prices do not cross any more
+   MATCH_EXHAUSTED,   // what is left of a buying taker can not buy a single unit at the best price
+   MATCH_FILL_LIMIT   // prices still cross but fills_left is used up
+};
+
+// what one fill moves, in raw units. base is the pair sell token, quote the pair buy token
+struct Deal {
+   uint64_t ticks;      // price of the maker
+   int64_t  base;
+   int64_t  quote;
+   int64_t  taker_fee;  // in the token the taker receives
+   int64_t  maker_fee;  // in the token the maker receives
+};
+
+struct Match_terms {
+   uint64_t tick_size;
+   uint64_t taker_fee;        // rates, see fee_rate
+   uint64_t maker_fee;
+   int64_t  maker_min_order;  // a maker left with less is closed
+};
+
+inline Deal make_deal(const uint8_t taker_side, const uint64_t ticks, const int64_t base, const price128_t price, const Match_terms& terms) {
+   Deal deal;
+   deal.ticks = ticks;
+   deal.base = base;
+   deal.quote = quote_for_base(base, price);
+   deal.taker_fee = fee_amount(taker_side == SIDE_BUY ? deal.base : deal.quote, terms.taker_fee);
+   deal.maker_fee = fee_amount(taker_side == SIDE_BUY ? deal.quote : deal.base, terms.maker_fee);
+   return deal;
+}
+
+// matches a taker with taker_left to sell against the opposite side of the market until prices
+// stop crossing or fills_left makers are taken. Market is the storage of the pair book:
+//    iterator best(uint8_t side)                       best resting order of the side
+//    bool     at_end(const iterator&)                  the side has no order
+//    uint64_t ticks(const iterator&)
+//    int64_t  left(const iterator&)                    what the order has left to sell
+//    void     fill(const iterator&, const Deal&)       records the fill of both orders
+//    void     close_maker(const iterator&, uint8_t)    takes the maker out of the book, see MAKER_CLOSE
+//    void     keep_maker(const iterator&, int64_t)     the maker stays with what it has left
+// a maker closed as too small without a fill counts as a fill. returns MATCH_END.
+template<typename Market>
+uint8_t match_orders(Market& market, const Match_terms& terms, const uint8_t side, const uint64_t ticks, int64_t& taker_left, uint32_t& fills_left) {
+   const uint8_t maker_side = side == SIDE_SELL ? SIDE_BUY : SIDE_SELL;
+
+   while(taker_left != 0) {
+      auto maker = market.best(maker_side);
+      if(market.at_end(maker))
+         return MATCH_DONE;
+
+      const uint64_t maker_ticks = market.ticks(maker);
+      if(side == SIDE_SELL ? maker_ticks < ticks : maker_ticks > ticks)
+         return MATCH_DONE;
+
+      if(fills_left == 0)
+         return MATCH_FILL_LIMIT;
+
+      const price128_t deal_price = price128_t(maker_ticks) * terms.tick_size;
+      const int64_t maker_left = market.left(maker);
+      const int64_t base_left = side == SIDE_SELL ? taker_left : maker_left;
+      const int64_t quote_left = side == SIDE_BUY ? taker_left : maker_left;
+
+      const int64_t base = std::min(base_left, base_for_quote(quote_left, deal_price));
+      if(base == 0) {
+         // what is left of the buy order does not buy a single unit
+         if(side == SIDE_BUY)
+            return MATCH_EXHAUSTED;
+         fills_left--;
+         market.close_maker(maker, MAKER_TOO_SMALL);
+         continue;
+      }
+
+      fills_left--;
+      const Deal deal = make_deal(side, maker_ticks, base, deal_price, terms);
+      taker_left -= side == SIDE_SELL ? deal.base : deal.quote;
+      const int64_t maker_left_after = maker_left - (side == SIDE_SELL ? deal.quote : deal.base);
+      market.fill(maker, deal);
+
+      // if both are left, the buy order can not afford one more unit at this price
+      const bool exhausted = maker_left_after != 0 && taker_left != 0;
+
+      if(maker_left_after == 0)
+         market.close_maker(maker, MAKER_FILLED);
+      else if((exhausted && maker_side == SIDE_BUY) || maker_left_after < terms.maker_min_order)
+         market.close_maker(maker, MAKER_TOO_SMALL);
+      else
+         market.keep_maker(maker, maker_left_after);
+
+      if(exhausted && side == SIDE_BUY)
+         return MATCH_EXHAUSTED;
+   }
+
+   return MATCH_DONE;
+}
+
+// candles are any struct with the fields of Bucket
+template<typename C>
+void candle_open(C& c, const double price, const double base_volume, const double quote_volume) {
+   c.high_base = price;
+   c.low_base = price;
+   c.open_base = price;
+   c.close_base = price;
+   c.base_volume = base_volume;
+   c.quote_volume = quote_volume;
+}
+
+template<typename C>
+void candle_update(C& c, const double price, const double base_volume, const double quote_volume) {
+   if(c.high_base < price)
+      c.high_base = price;
+   if(c.low_base > price)
+      c.low_base = price;
+   c.close_base = price;
+   c.base_volume += base_volume;
+   c.quote_volume += quote_volume;
+}
+
+// later is the later part of the candle
+template<typename C>
+void candle_merge(C& c, const C& later) {
+   if(c.high_base < later.high_base)
+      c.high_base = later.high_base;
+   if(c.low_base > later.low_base)
+      c.low_base = later.low_base;
+   c.close_base = later.close_base;
+   c.base_volume += later.base_volume;
+   c.quote_volume += later.quote_volume;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+
+// Fixed point prices. A price is the number of raw quote units paid for one raw
+// base unit, multiplied by PRICE_SCALE. Order books keep prices in ticks of
+// the pair's tick size, so price = ticks * tick_size.
+#define PRICE_SCALE 1000000000000ULL
+#define DEFAULT_TICK_SIZE 1
+// fee rates are kept in millionths, 0.1% == 1000
+#define FEE_SCALE 1000000ULL
+#define MAX_PRECISION 18
+
+typedef unsigned __int128 price128_t;
+
+// limit price of an order selling `base` for `quote` (or the other way round) in ticks,
+// rounded to the nearest tick on both sides so that an ask and a bid at the same price
+// get the same ticks and cross. an order may trade up to half a tick off its price.
+// the result may not fit into the 64 bit ticks of a book, see ticks_in_range
+inline price128_t to_ticks(const int64_t quote, const int64_t base, const uint64_t tick_size) {
+    const price128_t num = price128_t(quote) * PRICE_SCALE;
+    const price128_t den = price128_t(base) * tick_size;
+    return (num + den / 2) / den;
+}
+
+inline bool ticks_in_range(const price128_t ticks) {
+    return ticks != 0 && ticks <= UINT64_MAX;
+}
+
+// how much base can be bought for `quote` at `price` (ticks * tick_size)
+inline int64_t base_for_quote(const int64_t quote, const price128_t price) {
+    return int64_t(price128_t(quote) * PRICE_SCALE / price);
+}
+
+// how much quote is paid for `base` at `price`, rounded up in favour of the seller
+inline int64_t quote_for_base(const int64_t base, const price128_t price) {
+    return int64_t((price128_t(base) * price + PRICE_SCALE - 1) / PRICE_SCALE);
+}
+
+inline int64_t fee_amount(const int64_t amount, const uint64_t rate) {
+    return int64_t((price128_t(amount) * rate + FEE_SCALE - 1) / FEE_SCALE);
+}
+
+inline uint64_t fee_rate(const double percent) {
+    return uint64_t(percent * (FEE_SCALE / 100) + 0.5);
+}
+
+inline double pow10_double(const uint8_t n) {
+    static const double powers[MAX_PRECISION + 1] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+        1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18 };
+    return powers[n];
+}
+
+// human readable price, only used to keep the old double fields filled
+inline double to_double_price(const int64_t quote, const uint8_t quote_precision, const int64_t base, const uint8_t base_precision) {
+    return double(quote) / double(base) * pow10_double(base_precision) / pow10_double(quote_precision);
+}
+
+inline double ticks_to_double(const uint64_t ticks, const uint64_t tick_size, const uint8_t quote_precision, const uint8_t base_precision) {
+    return double(ticks) * double(tick_size) / double(PRICE_SCALE) * pow10_double(base_precision) / pow10_double(quote_precision);
+}
@@ -7,75 +7,231 @@ bool globalstate::token_permitted(const asset& a) const {
     return  permitted_tokens.find(a.symbol) != permitted_tokens.end();
 }
 
-std::optional<Pair_info> globalstate::pair_permitted(const asset& a, const asset& b) const {
-    
-    for(auto it = permitted_pairs.begin(); it != permitted_pairs.end(); it++)
-    {
-        if((it->sell == a.symbol && it->buy == b.symbol) ||
-           (it->sell == b.symbol && it->buy == a.symbol))
-            return *it;
-    }
-
-    return std::optional<Pair_info>();
- }
+uint64_t order_ticks(const symbol& pair_sell, const uint64_t tick_size, const asset& sell, const asset& buy) {
+    const price128_t ticks = pair_sell == sell.symbol ? to_ticks(buy.amount, sell.amount, tick_size)
+                                                      : to_ticks(sell.amount, buy.amount, tick_size);
+    check(ticks != 0, "order price is less than half a tick of the pair");
+    check(ticks <= UINT64_MAX, "order price is above the tick range of the pair");
+    return uint64_t(ticks);
+}
 
-const bool operator < (const Order& a, const Order& b) {
-    if(a.price < b.price) {
-        return true;
-    }
-    else if (a.price > b.price) {
-        return false;
-    }
-    else {
-        if(a.by_time() < b.by_time())
-            return true;
-        else if(a.by_time() > b.by_time())
-            return false;
-        else if(a.by_value() > b.by_value())
-            return true;
-        else if(a.by_value() < b.by_value())
-            return true;
-        else if(a.total_id < b.total_id)
-            return true;
-        else
-            return false;
-    }
+double order_price(const symbol& pair_sell, const uint64_t ticks, const uint64_t tick_size, const asset& sell, const asset& buy) {
+    if(pair_sell == sell.symbol)
+        return ticks_to_double(ticks, tick_size, buy.symbol.precision(), sell.symbol.precision());
+    return ticks_to_double(ticks, tick_size, sell.symbol.precision(), buy.symbol.precision());
 }
 
 void Order::update_average_price(const asset& r, const asset& p, const asset& f, bool convert) { 
     received += r;
     paid += p;
     check(sell >= paid, "error sell < paid");
-    average_price = (received.amount / pow(10,received.symbol.precision())) / (paid.amount / pow(10, paid.symbol.precision()));
     if(convert)
-        average_price = 1/average_price;
+        average_price = to_double_price(paid.amount, paid.symbol.precision(), received.amount, received.symbol.precision());
+    else
+        average_price = to_double_price(received.amount, received.symbol.precision(), paid.amount, paid.symbol.precision());
     received -= f;
     fee += f;
 }
 
-uint64_t dexchange::get_new_total_order_id() {
-    uint64_t id = gstate.total_order_id++;
-    global.set(gstate, _self);
+globalstate& dexchange::config() {
+    if(!config_cache.has_value())
+        config_cache = global.get_or_default();
+    return *config_cache;
+}
+
+uint32_t dexchange::fill_limit() {
+    const uint32_t max_fills = config().max_fills.value_or(0);
+    return max_fills != 0 ? max_fills : UINT32_MAX;
+}
+
+// fees are looked up several times by every order, so they are copied once per action
+// into a vector sorted by symbol. actions changing config().fee clear the cache
+const Fee_info& dexchange::fee_info(const symbol& s) {
+    if(fee_cache.empty())
+        fee_cache.assign(config().fee.begin(), config().fee.end());
+
+    auto it = std::lower_bound(fee_cache.begin(), fee_cache.end(), s,
+        [](const std::pair<symbol, Fee_info>& f, const symbol& s) { return f.first < s; });
+    check(it != fee_cache.end() && it->first == s, "token not permitted");
+    return it->second;
+}
+
+std::optional<Pair_info> dexchange::find_pair(const symbol& a, const symbol& b) {
+    auto symbols_index = pairs.get_index<"bysymbols"_n>();
+    auto it = symbols_index.find(pair_symbols(a, b));
+    if(it == symbols_index.end())
+        return std::optional<Pair_info>();
+    return *it;
+}
+
+// canceling orders looks up the pair of each order, so keys are cached for the action
+uint64_t dexchange::pair_key(const symbol& a, const symbol& b) {
+    const uint128_t symbols = pair_symbols(a, b);
+    auto it = pair_key_cache.find(symbols);
+    if(it != pair_key_cache.end())
+        return it->second;
+
+    auto p = find_pair(a, b);
+    check(p.has_value(), "assets pair not found");
+    pair_key_cache[symbols] = p->key;
+    return p->key;
+}
+
+// reserves count consecutive ids, returns the first one
+uint64_t dexchange::get_new_total_order_id(const uint64_t count) {
+    uint64_t id = counters().total_order_id;
+    counters().total_order_id += count;
+    save_counters();
     return id;
 }
 
-void Orders::insert_order(Order& o) {
-    if(sell == o.sell.symbol) {
-        sell_orders.push_front(o);
-        sell_orders.sort();
+counterstate& dexchange::counters() {
+    if(counter_cache.has_value())
+        return *counter_cache;
+
+    counterstate cstate;
+    if(counter.exists())
+        cstate = counter.get();
+    else
+        cstate.total_order_id = config().total_order_id;
+
+    if(!cstate.job_count.has_value()) {
+        uint32_t job_count = 0;
+        for(auto itr = jobs.begin(); itr != jobs.end(); itr++)
+            job_count++;
+        cstate.job_count.emplace(job_count);
+    }
+    if(!cstate.migrated.has_value())
+        cstate.migrated.emplace(false);
+
+    counter_cache = cstate;
+    return *counter_cache;
+}
+
+void dexchange::save_counters() {
+    counter.set(counters(), _self);
+}
+
+checksum256 Book_order::by_price() const {
+    // pending takers keep their limit in ticks but wait in time order
+    uint64_t price_key = side == SIDE_BUY ? ~ticks : side == SIDE_PENDING ? 0 : ticks;
+
+    return checksum256::make_from_word_sequence<uint64_t>(uint64_t(side), price_key, uint64_t(start_time.elapsed.count()), total_id);
+}
+
+Order_book::Order_book(const name& self, const uint64_t pair_key):
+    self(self),
+    book(self, pair_key),
+    index(book.get_index<"byprice"_n>())
+{
+}
+
+Order_book::const_iterator Order_book::best(const uint8_t side) {
+    auto& best = cached_best(side);
+    if(!best.has_value()) {
+        auto itr = index.lower_bound(checksum256::make_from_word_sequence<uint64_t>(uint64_t(side), 0ULL, 0ULL, 0ULL));
+        best = (itr != index.end() && itr->side == side) ? itr : index.end();
     }
-    else {
-        buy_orders.push_front(o);
-        buy_orders.sort();
+    return *best;
+}
+
+Order_book::const_iterator Order_book::find(const uint64_t total_id) const {
+    auto itr = book.find(total_id);
+    return itr == book.end() ? index.end() : index.iterator_to(*itr);
+}
+
+Order_book::const_iterator Order_book::first_pending() const {
+    auto itr = index.lower_bound(checksum256::make_from_word_sequence<uint64_t>(uint64_t(SIDE_PENDING), 0ULL, 0ULL, 0ULL));
+    return (itr != index.end() && itr->side == SIDE_PENDING) ? itr : index.end();
+}
+
+void Order_book::insert(const Order& o, const uint8_t side, const uint64_t ticks) {
+    auto itr = book.emplace(self, [&] (auto& b) {
+        b.total_id = o.total_id;
+        b.side = side;
+        b.owner = o.owner;
+        b.ticks = ticks;
+        b.start_time = o.start_time;
+        b.sell = o.sell;
+        b.buy = o.buy;
+        b.paid = o.paid;
+    });
+
+    if(side == SIDE_PENDING)
+        return;
+
+    auto& best = cached_best(side);
+    if(best.has_value() && (*best == index.end() || itr->by_price() < (*best)->by_price()))
+        best = index.iterator_to(*itr);
+}
+
+void Order_book::amend(const_iterator itr, const asset& sell, const asset& buy) {
+    // the caller keeps the price, the order keeps its place
+    index.modify(itr, self, [&] (auto& b) {
+        b.sell = sell;
+        b.buy = buy;
+    });
+}
+
+void Order_book::update(const_iterator itr, const asset& paid) {
+    // paid is not part of the price key, the order keeps its place
+    index.modify(itr, self, [&] (auto& b) {
+        b.paid = paid;
+    });
+}
+
+Order_book::const_iterator Order_book::erase(const_iterator itr) {
+    const uint8_t side = itr->side;
+    if(side == SIDE_PENDING)
+        return index.erase(itr);
+
+    auto& best = cached_best(side);
+    const bool was_best = best.has_value() && *best == itr;
+
+    auto next = index.erase(itr);
+    if(was_best)
+        best = (next != index.end() && next->side == side) ? next : index.end();
+    return next;
+}
+
+// the legacy tables are read until all of them are empty once, then only the flag is
+void dexchange::check_pair_migrated(const uint64_t pair_key) {
+    if(counters().migrated.value())
+        return;
+
+    check(all_orders.find(pair_key) == all_orders.end(), "order book of the pair is not migrated yet");
+    check_orders_migrated();
+    check_accounts_migrated();
+
+    if(all_orders.begin() == all_orders.end()) {
+        counters().migrated.value() = true;
+        save_counters();
     }
 }
 
-Order dexchange::init_order(    const name&    owner,
+void dexchange::check_accounts_migrated() {
+    if(counters().migrated.value())
+        return;
+    legacy_account_index legacy_accounts(_self, _self.value);
+    check(legacy_accounts.begin() == legacy_accounts.end(), "accounts are not migrated yet");
+}
+
+void dexchange::check_orders_migrated() {
+    if(counters().migrated.value())
+        return;
+    legacy_orders_info_index legacy_info(_self, _self.value);
+    check(legacy_info.begin() == legacy_info.end(), "orders are not migrated yet");
+}
+
+Order dexchange::init_order(    const uint64_t total_id,
+                                const name&    owner,
                                 const asset&   sell,
                                 const asset&   buy,
-                                const symbol&  sell_symbol) {
+                                const symbol&  sell_symbol,
+                                const uint64_t ticks,
+                                const uint64_t tick_size) {
     Order o;
-    o.total_id = get_new_total_order_id();
+    o.total_id = total_id;
     o.owner = owner;
     o.start_time = current_time_point();
     o.sell = sell;
@@ -85,12 +241,7 @@ Order dexchange::init_order(    const name&    owner,
     o.paid = sell;
     o.paid.amount = 0;
     o.fee = o.received;
-
-    if(sell_symbol == o.sell.symbol)
-        o.price = (buy.amount / pow(10,buy.symbol.precision())) / (sell.amount / pow(10,sell.symbol.precision()));
-    else
-        o.price = (sell.amount / pow(10,sell.symbol.precision())) / (buy.amount / pow(10,buy.symbol.precision()));
-
+    o.price = order_price(sell_symbol, ticks, tick_size, sell, buy);
     o.average_price = o.price;
     return o;
 }
@@ -99,54 +250,242 @@ void dexchange::order(  const name&    owner,
                         const asset&   sell,
                         const asset&   buy)
 {
+    placeorder(owner, sell, buy, ORDER_LIMIT);
+}
+
+void dexchange::placeorder(const name& owner, const asset& sell, const asset& buy, const uint8_t type) {
     require_auth(owner);
+    check(type <= ORDER_FOK, "wrong order type");
     check(blacklist.find(owner.value) == blacklist.end(), "This account has been blacklisted");
-    auto itr_owner = accounts.find(owner.value);
-    check(itr_owner != accounts.end(), "no owner found");
-    auto p = gstate.pair_permitted(sell, buy);
+    auto p = find_pair(sell.symbol, buy.symbol);
     check(p.has_value(), "pair is not permitted");
-    check(sell.amount != 0 && buy.amount != 0, "zero asset not permitted");
-    auto itr_balance = itr_owner->balances.find(sell.symbol);
-    check(itr_balance != itr_owner->balances.end(), "sell asset not found");
-    check(itr_balance->second.available >= sell, "sell asset not enough");
+    check(sell.amount > 0 && buy.amount > 0, "order amounts must be positive");
 
-    check(sell >= gstate.fee[sell.symbol].min_order, "the order is less than minimum order");
+    check(sell >= fee_info(sell.symbol).min_order, "the order is less than minimum order");
 
-    accounts.modify(itr_owner, _self, [&] (auto& acnt) {
-        acnt.balances[sell.symbol].available -= sell;
-        acnt.balances[sell.symbol].used += sell;
-    });
+    check_pair_migrated(p->key);
+    check_no_job(*p);
+
+    balance_cache.lock(owner, sell);
+    fills_left = fill_limit();
+
+    Order_book book(_self, p->key);
+    Candle_aggregator candles(_self, p->key);
+    place_order(get_new_total_order_id(), owner, sell, buy, type, *p, book, candles);
+    flush_candles(*p, candles);
+    balance_cache.flush();
+}
+
+// all orders are validated first, their funds are locked with one write per token and their ids
+// are reserved with one counter write. orders of one pair share the book and candles
+void dexchange::placebatch(const name& owner, const std::vector<order_spec>& orders) {
+    require_auth(owner);
+    check(!orders.empty(), "no orders");
+    check(blacklist.find(owner.value) == blacklist.end(), "This account has been blacklisted");
+
+    std::map<uint128_t, Pair_info> batch_pairs;
+    std::vector<uint128_t> order_pairs;
+    std::map<symbol, asset> to_lock;
+
+    for(const order_spec& spec: orders) {
+        uint128_t symbols = pair_symbols(spec.sell.symbol, spec.buy.symbol);
+        if(batch_pairs.find(symbols) == batch_pairs.end()) {
+            auto p = find_pair(spec.sell.symbol, spec.buy.symbol);
+            check(p.has_value(), "pair is not permitted");
+            check_pair_migrated(p->key);
+            check_no_job(*p);
+            batch_pairs[symbols] = *p;
+        }
+        order_pairs.push_back(symbols);
+
+        check(spec.sell.amount > 0 && spec.buy.amount > 0, "order amounts must be positive");
+        check(spec.type <= ORDER_FOK, "wrong order type");
+        check(spec.sell >= fee_info(spec.sell.symbol).min_order, "the order is less than minimum order");
+
+        if(to_lock.find(spec.sell.symbol) == to_lock.end())
+            to_lock[spec.sell.symbol] = spec.sell;
+        else
+            to_lock[spec.sell.symbol] += spec.sell;
+    }
+
+    for(auto lock_itr = to_lock.begin(); lock_itr != to_lock.end(); lock_itr++)
+        balance_cache.lock(owner, lock_itr->second);
+
+    const uint64_t first_id = get_new_total_order_id(orders.size());
+    fills_left = fill_limit();
+
+    for(auto pair_itr = batch_pairs.begin(); pair_itr != batch_pairs.end(); pair_itr++) {
+        const Pair_info& pair = pair_itr->second;
+        Order_book book(_self, pair.key);
+        Candle_aggregator candles(_self, pair.key);
+
+        for(size_t i = 0; i < orders.size(); i++)
+            if(order_pairs[i] == pair_itr->first)
+                place_order(first_id + i, owner, orders[i].sell, orders[i].buy, orders[i].type, pair, book, candles);
+
+        flush_candles(pair, candles);
+    }
+
+    balance_cache.flush();
+}
+
+void dexchange::flush_candles(const Pair_info& pair, Candle_aggregator& candles) {
+    const uint32_t now = current_time_point().sec_since_epoch();
+    const bool rollup = config().rollup_active(now);
+    if(candles.flush(config().buckets, rollup) && rollup)
+        rollup_candles(pair.key, candles, now / config().buckets.front() * config().buckets.front(), ROLLUP_ON_ORDER);
+}
+
+// the order is validated and its funds are locked already
+void dexchange::place_order(const uint64_t total_id, const name& owner, const asset& sell, const asset& buy, const uint8_t type,
+                            const Pair_info& pair, Order_book& book, Candle_aggregator& candles) {
+
+    const uint64_t ticks = order_ticks(pair.sell, pair.tick_size, sell, buy);
+
+    Order o = init_order(total_id, owner, sell, buy, pair.sell, ticks, pair.tick_size);
+    if(type == ORDER_POST_ONLY)
+        post_order(pair, book, o, ticks);
+    else if(type == ORDER_IOC || type == ORDER_FOK)
+        take_order(pair, book, candles, o, ticks, type);
+    else
+        submit_order(pair, book, candles, o, ticks, false);
+}
 
-    Order o = init_order(owner, sell, buy, p->sell);
+// rests the order without a matching pass, only the best price of the other side is looked at.
+// pending takers do not hold it back, they can only make it a maker
+void dexchange::post_order(const Pair_info& pair, Order_book& book, const Order& o, const uint64_t ticks) {
+    const uint8_t side = o.sell.symbol == pair.sell ? SIDE_SELL : SIDE_BUY;
+    auto best = book.best(side == SIDE_SELL ? SIDE_BUY : SIDE_SELL);
+    check(best == book.end() || (side == SIDE_SELL ? best->ticks < ticks : best->ticks > ticks), "post-only order would take liquidity");
 
-    auto itr_all_orders = all_orders.find(sell.symbol.raw()^buy.symbol.raw());
-    if(itr_all_orders == all_orders.end())
-        itr_all_orders = all_orders.emplace(_self, [&] (auto& table) {
-            table.sell = p->sell;
-            table.buy = p->buy;
-            table.insert_order(o);
+    rest_order(book, o, side, ticks, false);
+}
+
+// matches the order after the pending takers and never rests it, so it has no book or info row.
+// what is left goes back to the available balance, a FOK order fails the action unless it is filled
+void dexchange::take_order(const Pair_info& pair, Order_book& book, Candle_aggregator& candles, Order& o, const uint64_t ticks, const uint8_t type) {
+    const uint8_t side = o.sell.symbol == pair.sell ? SIDE_SELL : SIDE_BUY;
+
+    uint8_t end = MATCH_FILL_LIMIT;
+    if(run_pending(pair, book, candles))
+        end = matching(pair, book, candles, o, side, ticks);
+
+    // an exhausted buy order has less left than one unit at the best price
+    const bool filled = o.sell == o.paid || end == MATCH_EXHAUSTED;
+    check(type != ORDER_FOK || filled, "fill-or-kill order can not be filled");
+
+    const asset left = o.sell - o.paid;
+    if(left.amount != 0)
+        balance_cache.unlock(o.owner, left);
+
+    order_to_history(o, filled ? CLOSED_NORMALLY : CLOSED_NOT_FILLED_IMMEDIATELY);
+}
+
+// takers stopped by the fill limit go first, an order waits behind them if they are not done
+void dexchange::submit_order(const Pair_info& pair, Order_book& book, Candle_aggregator& candles, Order& o, const uint64_t ticks, const bool has_info) {
+    if(run_pending(pair, book, candles))
+        match_and_rest(pair, book, candles, o, ticks, has_info);
+    else
+        rest_order(book, o, SIDE_PENDING, ticks, has_info);
+}
+
+// matches pending takers oldest first while fills are left, returns true if none is left
+bool dexchange::run_pending(const Pair_info& pair, Order_book& book, Candle_aggregator& candles) {
+    for(auto itr = book.first_pending(); itr != book.end(); itr = book.first_pending()) {
+        if(fills_left == 0)
+            return false;
+
+        Order o = all_orders_info.get(itr->total_id, "order info not found");
+        const uint64_t ticks = itr->ticks;
+        book.erase(itr);
+        match_and_rest(pair, book, candles, o, ticks, true);
+    }
+    return true;
+}
+
+// matches the order and rests what is left in the book. has_info tells if the order
+// has an info row already, which is the case for an amended or pending order
+void dexchange::match_and_rest(const Pair_info& pair, Order_book& book, Candle_aggregator& candles, Order& o, const uint64_t ticks, const bool has_info) {
+    const uint8_t side = o.sell.symbol == pair.sell ? SIDE_SELL : SIDE_BUY;
+
+    const uint8_t end = matching(pair, book, candles, o, side, ticks);
+
+    if(o.sell == o.paid)
+        order_to_history(o, CLOSED_NORMALLY);
+    else if(end == MATCH_FILL_LIMIT)
+        rest_order(book, o, SIDE_PENDING, ticks, has_info);
+    else if(end == MATCH_EXHAUSTED || o.sell - o.paid < fee_info(o.sell.symbol).min_order)
+        close_order(o, CLOSED_BY_MINIMUM_ORDER_SIZE);
+    else
+        rest_order(book, o, side, ticks, has_info);
+}
+
+void dexchange::rest_order(Order_book& book, const Order& o, const uint8_t side, const uint64_t ticks, const bool has_info) {
+    book.insert(o, side, ticks);
+    if(has_info)
+        all_orders_info.modify(all_orders_info.find(o.total_id), _self, [&] (auto& order) {
+            order = o;
         });
     else
-        all_orders.modify(itr_all_orders, _self, [&] (auto& table) {
-            table.insert_order(o);
+        all_orders_info.emplace(_self, [&] (auto& order) {
+            order = o;
         });
+}
 
-    all_orders_info.emplace(_self, [&] (auto& order) {
-        order = o;
-    });
+// changes a resting order without closing it, only the difference of the locked funds moves
+// between available and used. an order keeps its time priority if its price stays and it
+// does not grow, otherwise it is taken out of the book and placed again like a new order
+void dexchange::amend(const name& owner, const uint64_t order_id, const asset& new_sell, const asset& new_buy) {
+    require_auth(owner);
+    check(blacklist.find(owner.value) == blacklist.end(), "This account has been blacklisted");
+    check_orders_migrated();
 
-    matching(itr_all_orders->sell_orders, itr_all_orders->buy_orders);
-}
+    auto itr_info = all_orders_info.find(order_id);
+    check(itr_info != all_orders_info.end() && itr_info->owner == owner, "order not found");
+    Order o = *itr_info;
 
-Order get_maker(const Order& a, const Order& b) {
+    check(new_sell.symbol == o.sell.symbol && new_buy.symbol == o.buy.symbol, "order symbols can not change");
+    check(new_sell.amount > 0 && new_buy.amount > 0, "order amounts must be positive");
+    check(new_sell != o.sell || new_buy != o.buy, "nothing to amend");
+    check(new_sell > o.paid && new_sell - o.paid >= fee_info(new_sell.symbol).min_order, "the order is less than minimum order");
 
-    if (a.start_time < b.start_time)
-        return a;
-    if (b.start_time < a.start_time)
-        return b;
-    if (a.total_id < b.total_id)
-        return a;
-    return b;
+    auto p = find_pair(new_sell.symbol, new_buy.symbol);
+    check(p.has_value(), "pair is not permitted");
+    check_pair_migrated(p->key);
+    check_no_job(*p);
+
+    const uint64_t ticks = order_ticks(p->sell, p->tick_size, new_sell, new_buy);
+
+    Order_book book(_self, p->key);
+    auto itr_book = book.find(order_id);
+    check(itr_book != book.end(), "order not found in the book");
+    check(itr_book->side != SIDE_PENDING, "the order is pending match");
+
+    const asset delta = new_sell - o.sell;
+    if(delta.amount != 0)
+        balance_cache.lock(owner, delta);
+
+    o.sell = new_sell;
+    o.buy = new_buy;
+    o.price = order_price(p->sell, ticks, p->tick_size, new_sell, new_buy);
+
+    if(ticks == itr_book->ticks && delta.amount <= 0) {
+        book.amend(itr_book, new_sell, new_buy);
+        all_orders_info.modify(itr_info, _self, [&] (auto& order) {
+            order = o;
+        });
+        balance_cache.flush();
+        return;
+    }
+
+    book.erase(itr_book);
+    o.start_time = current_time_point();
+    fills_left = fill_limit();
+
+    Candle_aggregator candles(_self, p->key);
+    submit_order(*p, book, candles, o, ticks, true);
+    flush_candles(*p, candles);
+    balance_cache.flush();
 }
 
 void dexchange::order_to_history(const Order& o, uint8_t close_status) {
@@ -165,373 +504,530 @@ void dexchange::order_to_history(const Order& o, uint8_t close_status) {
         h.price = o.price;
         h.average_price = o.average_price;
     });
+    count_history(o.owner);
+
+    // the row may be pruned, the trace of histlog keeps the record
+    action{
+        permission_level{_self, "active"_n},
+        _self,
+        "histlog"_n,
+        std::make_tuple(*h)
+    }.send();
+
+    // orders filled before resting in the book have no info row
+    auto itr_info = all_orders_info.find(o.total_id);
+    if(itr_info != all_orders_info.end())
+        all_orders_info.erase(itr_info);
+}
 
-    auto itr_info = all_orders_info.find(o.start_time.elapsed.count() ^ o.total_id);
-    all_orders_info.erase(itr_info);    
+void dexchange::histlog(const History& h) {
+    require_auth(_self);
 }
 
-void dexchange::modify_orders_info(Order& o) {
-    auto itr_info = all_orders_info.find(o.start_time.elapsed.count() ^ o.total_id);
-    all_orders_info.modify(itr_info, _self, [&] (auto& order) {
-        order = o;
-    }); 
+void dexchange::fillevent(const Fill_event& e) {
+    require_auth(_self);
 }
 
-void Bucket::update(asset& sell, asset& buy, double price) {
-    if(high_base < price)
-        high_base = price;
-    if(low_base > price)
-        low_base = price;
-    close_base = price;
-    base_volume += (sell.amount / pow(10, sell.symbol.precision()));
-    quote_volume += (buy.amount / pow(10, buy.symbol.precision()));
+// 0 turns a limit off. with both off closed orders are kept forever
+void dexchange::setmaxfills(const uint32_t max_fills) {
+    require_auth(_self);
+
+    // binary extensions are written in order, the ones before need a value
+    config().rollup_since.emplace(config().rollup_since.value_or(0));
+    config().history_entries.emplace(config().history_entries.value_or(0));
+    config().history_days.emplace(config().history_days.value_or(0));
+    config().max_fills.emplace(max_fills);
+    global.set(config(), _self);
 }
 
-void dexchange::update_buckets(asset& sell, asset& buy, double price) {
+void dexchange::sethistory(const uint32_t max_entries, const uint32_t max_days) {
+    require_auth(_self);
 
-    Bucket init_bucket;
-    init_bucket.base = sell.symbol;
-    init_bucket.quote = buy.symbol;
-    init_bucket.high_base = price;
-    init_bucket.low_base = price;
-    init_bucket.open_base = price;
-    init_bucket.close_base = price;
-    init_bucket.base_volume = sell.amount / pow(10, sell.symbol.precision());
-    init_bucket.quote_volume = buy.amount / pow(10, buy.symbol.precision());
+    // binary extensions are written in order, the ones before need a value
+    config().rollup_since.emplace(config().rollup_since.value_or(0));
+    config().history_entries.emplace(max_entries);
+    config().history_days.emplace(max_days);
+    global.set(config(), _self);
+}
 
-    auto bucket_indx1 = buckets1.get_index<"bypairtime"_n>();
-    auto bucket_indx2 = buckets2.get_index<"bypairtime"_n>();
-    auto bucket_indx3 = buckets3.get_index<"bypairtime"_n>();
-    auto bucket_indx4 = buckets4.get_index<"bypairtime"_n>();
-    auto bucket_indx5 = buckets5.get_index<"bypairtime"_n>();
-    auto bucket_indx6 = buckets6.get_index<"bypairtime"_n>();
-    auto bucket_indx7 = buckets7.get_index<"bypairtime"_n>();
+// anyone can prune. closed orders of the owner are erased oldest first while they are
+// not among the last history_entries ones or are older than history_days
+// a call costs O(max_rows): the rows of an owner are counted once, max_rows at a time,
+// then the count tells how many of the oldest ones are over history_entries
+void dexchange::prunehist(const name& owner, const uint32_t max_rows) {
+    const uint32_t max_entries = config().history_entries.value_or(0);
+    const uint32_t max_days = config().history_days.value_or(0);
+    check(max_entries != 0 || max_days != 0, "history is kept forever");
+
+    // migrated rows are older than the ones counted already
+    legacy_history_index legacy_history(_self, _self.value);
+    check(legacy_history.begin() == legacy_history.end(), "history is not migrated yet");
+
+    const int64_t cutoff = max_days == 0 ? 0 : current_time_point().elapsed.count() - int64_t(max_days) * 86400 * 1000000;
+
+    auto end_owner_index = orders_history.get_index<"byendtowner"_n>();
+    auto first = end_owner_index.lower_bound(uint128_t(owner.value) << 64);
+    auto last = end_owner_index.upper_bound((uint128_t(owner.value) << 64) | UINT64_MAX);
+
+    history_count_index counts(_self, _self.value);
+    auto count_itr = counts.find(owner.value);
+    History_count count;
+    count.owner = owner;
+    if(count_itr != counts.end())
+        count = *count_itr;
+
+    uint32_t processed = 0;
+    if(!count.counted) {
+        auto itr = first;
+        if(count.cursor != 0) {
+            itr = end_owner_index.lower_bound(count.cursor);
+            for(uint32_t i = 0; i < count.at_cursor && itr != last; i++)
+                itr++;
+        }
+        for(; itr != last && processed < max_rows; itr++, processed++) {
+            count.entries++;
+            const uint128_t key = itr->by_end_time_owner();
+            count.at_cursor = key == count.cursor ? count.at_cursor + 1 : 1;
+            count.cursor = key;
+        }
+        count.counted = itr == last;
+    }
 
+    uint32_t pruned = 0;
+    if(count.counted) {
+        uint64_t over = max_entries != 0 && count.entries > max_entries ? count.entries - max_entries : 0;
+        for(auto itr = first; itr != last && processed < max_rows; processed++, pruned++) {
+            if(over == 0 && itr->end_time.elapsed.count() >= cutoff)
+                break;
+            if(over != 0)
+                over--;
+            itr = end_owner_index.erase(itr);
+        }
+        count.entries -= pruned;
+    }
+
+    check(processed != 0, "nothing to prune");
+    if(count_itr == counts.end())
+        counts.emplace(_self, [&] (auto& c) {
+            c = count;
+        });
+    else
+        counts.modify(count_itr, _self, [&] (auto& c) {
+            c = count;
+        });
+    eosio::print(" pruned=", pruned);
+}
+
+// keeps the count of an owner prunehist has counted already
+void dexchange::count_history(const name& owner) {
+    history_count_index counts(_self, _self.value);
+    auto itr = counts.find(owner.value);
+    if(itr != counts.end() && itr->counted)
+        counts.modify(itr, _self, [&] (auto& c) {
+            c.entries++;
+        });
+}
+
+void Bucket::update(const asset& sell, const asset& buy, double price) {
+    candle_update(*this, price, sell.amount / pow10_double(sell.symbol.precision()), buy.amount / pow10_double(buy.symbol.precision()));
+}
+
+void Bucket::merge(const Bucket& b) {
+    candle_merge(*this, b);
+}
+
+Candle_aggregator::Candle_aggregator(const name& self, const uint64_t pair_key):
+    self(self),
+    candles(self, pair_key)
+{
+}
+
+void Candle_aggregator::add(const asset& sell, const asset& buy, const double price) {
+    if(fills.has_value()) {
+        fills->update(sell, buy, price);
+        return;
+    }
+
+    fills.emplace();
+    fills->base = sell.symbol;
+    fills->quote = buy.symbol;
+    candle_open(*fills, price, sell.amount / pow10_double(sell.symbol.precision()), buy.amount / pow10_double(buy.symbol.precision()));
+}
+
+// writes the collected fills, returns true if a candle of the finest interval was opened
+bool Candle_aggregator::flush(const std::vector<uint32_t>& intervals, const bool finest_only) {
+    if(!fills.has_value())
+        return false;
+
+    bool opened = false;
     uint64_t cur_time_seconds = current_time_point().sec_since_epoch ();
 
-    for(uint32_t bucket: gstate.buckets) {
+    for(uint32_t bucket: intervals) {
 
         uint64_t bucket_num =  cur_time_seconds / bucket;
         time_point_sec open = time_point_sec() + bucket_num * bucket;
-        
-        init_bucket.open = open;
-        init_bucket.bucket = bucket;
-
-        uint64_t key = sell.symbol.raw()^buy.symbol.raw()^open.sec_since_epoch();
-
-        auto bucket_itr1 = bucket_indx1.find(key);
-        auto bucket_itr2 = bucket_indx2.find(key);
-        auto bucket_itr3 = bucket_indx3.find(key);
-        auto bucket_itr4 = bucket_indx4.find(key);
-        auto bucket_itr5 = bucket_indx5.find(key);
-        auto bucket_itr6 = bucket_indx6.find(key);
-        auto bucket_itr7 = bucket_indx7.find(key);
-
-        switch(bucket) {
-            case 60:
-                if(bucket_itr1 == bucket_indx1.end()) {
-                    buckets1.emplace( _self, [&] (auto& b) {
-                        b = init_bucket;
-                        b.id = buckets1.available_primary_key();
-                    });
-                }
-                else {
-                    bucket_indx1.modify(bucket_itr1, _self, [&] (auto& b) {
-                        b.update(sell, buy, price);
-                    });
-                }
-                break;
-            
-            case 300:
-                if(bucket_itr2 == bucket_indx2.end()) {
-                    buckets2.emplace( _self, [&] (auto& b) {
-                        b = init_bucket;
-                        b.id = buckets2.available_primary_key();
-                    });
-                }
-                else {
-                    bucket_indx2.modify(bucket_itr2, _self, [&] (auto& b) {
-                        b.update(sell, buy, price);
-                    });
-                }
-                break;
 
-            case 900:
-                if(bucket_itr3 == bucket_indx3.end()) {
-                    buckets3.emplace( _self, [&] (auto& b) {
-                        b = init_bucket;
-                        b.id = buckets3.available_primary_key();
-                    });
-                }
-                else {
-                    bucket_indx3.modify(bucket_itr3, _self, [&] (auto& b) {
-                        b.update(sell, buy, price);
-                    });
-                }
-                break;
+        auto bucket_itr = candles.find(Bucket::candle_key(bucket, open));
+        if(bucket_itr == candles.end()) {
+            candles.emplace( self, [&] (auto& b) {
+                b = *fills;
+                b.bucket = bucket;
+                b.open = open;
+            });
+            opened = opened || bucket == intervals.front();
+        }
+        else {
+            candles.modify(bucket_itr, self, [&] (auto& b) {
+                b.merge(*fills);
+            });
+        }
 
-            case 1800:
-                if(bucket_itr4 == bucket_indx4.end()) {
-                    buckets4.emplace( _self, [&] (auto& b) {
-                        b = init_bucket;
-                        b.id = buckets4.available_primary_key();
-                    });
-                }
-                else {
-                    bucket_indx4.modify(bucket_itr4, _self, [&] (auto& b) {
-                        b.update(sell, buy, price);
-                    });
-                }
-                break;
+        if(finest_only)
+            break;
+    }
 
-            case 3600:
-                if(bucket_itr5 == bucket_indx5.end()) {
-                    buckets5.emplace( _self, [&] (auto& b) {
-                        b = init_bucket;
-                        b.id = buckets5.available_primary_key();
-                    });
-                }
-                else {
-                    bucket_indx5.modify(bucket_itr5, _self, [&] (auto& b) {
-                        b.update(sell, buy, price);
-                    });
-                }
-                break;
+    fills.reset();
+    return opened;
+}
 
-            case 14400:
-                if(bucket_itr6 == bucket_indx6.end()) {
-                    buckets6.emplace( _self, [&] (auto& b) {
-                        b = init_bucket;
-                        b.id = buckets6.available_primary_key();
-                    });
-                }
-                else {
-                    bucket_indx6.modify(bucket_itr6, _self, [&] (auto& b) {
-                        b.update(sell, buy, price);
-                    });
-                }
-                break;
+// merges the finest candles opened in [rolled_until, until) into the coarser intervals, oldest first
+uint32_t Candle_aggregator::roll_up(const std::vector<uint32_t>& intervals, uint32_t& rolled_until, const uint32_t until, const uint32_t max_candles) {
+    const uint32_t finest = intervals.front();
+    uint32_t rolled = 0;
 
-            case 86400:
-                if(bucket_itr7 == bucket_indx7.end()) {
-                    buckets7.emplace( _self, [&] (auto& b) {
-                        b = init_bucket;
-                        b.id = buckets7.available_primary_key();
-                    });
-                }
-                else {
-                    bucket_indx7.modify(bucket_itr7, _self, [&] (auto& b) {
-                        b.update(sell, buy, price);
-                    });
-                }
-                break;
+    auto itr = candles.lower_bound(Bucket::candle_key(finest, time_point_sec(rolled_until)));
+    for(; itr != candles.end() && itr->bucket == finest && itr->open.sec_since_epoch() < until && rolled < max_candles; itr++, rolled++) {
 
-        } // switch
+        for(auto interval_itr = intervals.begin() + 1; interval_itr != intervals.end(); interval_itr++) {
+            time_point_sec open = time_point_sec(itr->open.sec_since_epoch() / *interval_itr * *interval_itr);
+
+            auto bucket_itr = candles.find(Bucket::candle_key(*interval_itr, open));
+            if(bucket_itr == candles.end()) {
+                candles.emplace( self, [&] (auto& b) {
+                    b = *itr;
+                    b.bucket = *interval_itr;
+                    b.open = open;
+                });
+            }
+            else {
+                candles.modify(bucket_itr, self, [&] (auto& b) {
+                    b.merge(*itr);
+                });
+            }
+        }
+
+        rolled_until = itr->open.sec_since_epoch() + finest;
     }
+
+    // nothing is left before until
+    if(rolled < max_candles)
+        rolled_until = until;
+
+    return rolled;
 }
 
 void dexchange::send_order_tokens(const eosio::name& from, const eosio::name& to, const eosio::asset& quantity, const eosio::asset& fee) {
 
-    auto itr_from = accounts.find(from.value);
-    auto itr_balance = itr_from->balances.find(quantity.symbol);
-    check(itr_balance->second.available >= quantity, "not enough balance");
-
-    accounts.modify(itr_from, _self, [&] (auto& acnt){
-        acnt.balances[quantity.symbol].used -= quantity;
-    });
+    balance_cache.debit_used(from, quantity);
 
     check(quantity.amount - fee.amount > 0, " error empty order transfer");
-    send_transfer(to, quantity - fee, std::string("Fill order"));
+    if(settlement.find(to.value) != settlement.end())
+        balance_cache.credit(to, quantity - fee);
+    else
+        send_transfer(to, quantity - fee, std::string("Fill order"));
 
-    if(fee.amount > 0) {
-        check(fee.amount >= 10, "fee too small");
-        asset gl_fee = fee * GL_PERCENT / 100;
-        asset sig_fee = fee * SIG_PERCENT / 100;
-        if(gl_fee + sig_fee < fee)
-            gl_fee += fee - gl_fee - sig_fee;
+    if(fee.amount > 0)
+        accrue_fee(fee);
+}
 
-        eosio::print(" gl_fee=", gl_fee);
-        eosio::print(" sig_fee=", sig_fee);
+Balance_cache::Balance_cache(const name& self):
+    self(self)
+{
+}
 
-        check(gl_fee + sig_fee == fee, " wrong fee asset");
+// a row is read on first use and kept until flush
+Balance_cache::Cached_balance& Balance_cache::row(const name& owner, const symbol& s) {
+    const auto key = std::make_pair(s.code().raw(), owner.value);
+    auto itr = rows.find(key);
+    if(itr != rows.end())
+        return itr->second;
+
+    Cached_balance& cached = rows[key];
+    balance_index& balances = table(s.code().raw());
+    auto balance_itr = balances.find(owner.value);
+    cached.exists = balance_itr != balances.end();
+    cached.dirty = false;
+    if(cached.exists)
+        cached.balance = *balance_itr;
+    else
+        cached.balance = Balance{owner, 0, 0};
+    return cached;
+}
 
-        send_transfer(name(sig_fee_account), sig_fee, std::string("Revenue from exchange"));
-        send_transfer(name(gl_fee_account), gl_fee, std::string("Revenue from exchange"));
-    }
+balance_index& Balance_cache::table(const uint64_t code) {
+    auto itr = tables.find(code);
+    if(itr == tables.end())
+        itr = tables.emplace(std::piecewise_construct, std::forward_as_tuple(code), std::forward_as_tuple(self, code)).first;
+    return itr->second;
 }
 
-void dexchange::matching(std::list<Order> sell, std::list<Order> buy)
-{
-    if(sell.size() == 0 || buy.size() == 0){
-        eosio::print(" no sell or buy orders");
-        return;
-    }
+// moves quantity of the owner from available to used, a negative quantity moves it back
+void Balance_cache::lock(const name& owner, const asset& quantity) {
+    Cached_balance& cached = row(owner, quantity.symbol);
+    check(cached.exists, "sell asset not found");
+    check(cached.balance.available >= quantity.amount, "sell asset not enough");
 
-    double buy_max = buy.back().price;
-    double sell_min = sell.begin()->price;
+    cached.balance.available -= quantity.amount;
+    cached.balance.used += quantity.amount;
+    cached.dirty = true;
+}
 
-    uint64_t table_key = sell.begin()->sell.symbol.raw()^sell.begin()->buy.symbol.raw();
-    bool empty_buy = false, empty_sell = false;
+void Balance_cache::debit_used(const name& owner, const asset& quantity) {
+    Cached_balance& cached = row(owner, quantity.symbol);
+    check(cached.exists && cached.balance.used >= quantity.amount, "not enough balance");
 
-    for(auto order_buy = buy.begin(); order_buy != buy.end();)
-    {
-        empty_buy = false;
-        if(sell.size() == 0) {
-            eosio::print(" no sell orders.");
-            break;
-        }
+    cached.balance.used -= quantity.amount;
+    cached.dirty = true;
+}
 
-        if(buy_max < sell_min) {
-            eosio::print(" no common price");
-            break;
-        }
+void Balance_cache::unlock(const name& owner, const asset& quantity) {
+    Cached_balance& cached = row(owner, quantity.symbol);
+    check(cached.exists && cached.balance.used >= quantity.amount, "not enough balance");
+
+    cached.balance.used -= quantity.amount;
+    cached.balance.available += quantity.amount;
+    cached.dirty = true;
+}
+
+void Balance_cache::credit(const name& owner, const asset& quantity) {
+    Cached_balance& cached = row(owner, quantity.symbol);
+    cached.balance.available += quantity.amount;
+    cached.dirty = true;
+}
 
-        if(order_buy->price < sell.begin()->price) {
-            eosio::print(" bad price 1.");
-            order_buy++;
+// writes each changed row once. the cache is emptied, so rows written by other
+// code after the flush are read again
+void Balance_cache::flush() {
+    for(auto itr = rows.begin(); itr != rows.end(); itr++) {
+        const Cached_balance& cached = itr->second;
+        if(!cached.dirty)
             continue;
-        }
 
-        for(auto order_sell = sell.begin(); order_sell != sell.end();)
-        {
-             eosio::print(" order_buy_balance=", order_buy->sell - order_buy->paid);
-             eosio::print(" order_sell_balance=", order_sell->sell - order_sell->paid);
-            // если цена не подходит - переходим к следующему ордеру на покупку
-            if(order_buy->price < order_sell->price) {
-                eosio::print(" bad price 2.");
-                order_buy++;
-                break;
-            }
+        balance_index& balances = table(itr->first.first);
+        if(cached.exists)
+            balances.modify(balances.find(itr->first.second), self, [&] (auto& b) {
+                b = cached.balance;
+            });
+        else
+            balances.emplace(self, [&] (auto& b) {
+                b = cached.balance;
+            });
+    }
 
-            std::pair<std::list<Order>::iterator, std::list<Order>::iterator> pair = std::pair(order_buy, order_sell);
+    rows.clear();
+    tables.clear();
+}
 
-            double buy_fee, sell_fee;
-            Order maker_order = get_maker(*order_buy, *order_sell);
-            eosio::print(" order_price=", maker_order.price);
+// fees are paid to the fee accounts by claimfees, not on every fill
+void dexchange::accrue_fee(const asset& fee) {
+    auto itr = fees.find(fee.symbol.code().raw());
+    if(itr == fees.end()) {
+        fees.emplace(_self, [&] (auto& f) {
+            f.amount = fee;
+        });
+    }
+    else {
+        fees.modify(itr, _self, [&] (auto& f) {
+            f.amount += fee;
+        });
+    }
+}
 
-            if(order_buy->sell.symbol == maker_order.sell.symbol) {
-                buy_fee = gstate.fee[order_buy->buy.symbol].maker_fee;
-                sell_fee = gstate.fee[order_sell->buy.symbol].taker_fee;
-            }
-            else {
-                sell_fee = gstate.fee[order_sell->buy.symbol].maker_fee;
-                buy_fee = gstate.fee[order_buy->buy.symbol].taker_fee;
-            }
+void dexchange::pay_fees(fees_index::const_iterator itr) {
+    const asset& fee = itr->amount;
+    if(fee.amount == 0)
+        return;
 
-            // определяем сколько по этой цене один может купить а другой продать.
-            asset order_sell_max = order_sell->sell - order_sell->paid;
+    asset gl_fee = fee * GL_PERCENT / 100;
+    asset sig_fee = fee * SIG_PERCENT / 100;
+    if(gl_fee + sig_fee < fee)
+        gl_fee += fee - gl_fee - sig_fee;
 
-            double buy_amount_max = (order_buy->sell.amount - order_buy->paid.amount) * pow(10,order_buy->buy.symbol.precision());
-            buy_amount_max /= maker_order.price * pow(10,order_buy->sell.symbol.precision());
+    eosio::print(" gl_fee=", gl_fee);
+    eosio::print(" sig_fee=", sig_fee);
 
-            uint64_t cur_deal_value = std::min(order_sell_max.amount, (int64_t)buy_amount_max);
+    check(gl_fee + sig_fee == fee, " wrong fee asset");
 
-            asset order_buy_asset = asset(cur_deal_value, order_buy->buy.symbol);
-            eosio::print(" order_buy=", order_buy_asset);
+    if(sig_fee.amount > 0)
+        send_transfer(name(sig_fee_account), sig_fee, std::string("Revenue from exchange"));
+    if(gl_fee.amount > 0)
+        send_transfer(name(gl_fee_account), gl_fee, std::string("Revenue from exchange"));
 
-            double order_sell_amount = cur_deal_value * maker_order.price * pow(10, order_buy->sell.symbol.precision()) / pow(10,order_buy->buy.symbol.precision());
-            asset order_sell_asset = asset(ceil(order_sell_amount), order_buy->sell.symbol);
+    fees.modify(itr, _self, [&] (auto& f) {
+        f.amount.amount = 0;
+    });
+}
 
-            eosio::print(" order_sell=", order_sell_asset);
+// with internal settlement the proceeds of fills stay on the exchange until withdraw
+void dexchange::setsettle(const name& owner, const bool internal) {
+    require_auth(owner);
+    check(blacklist.find(owner.value) == blacklist.end(), "This account has been blacklisted");
+    check_accounts_migrated();
 
-            double sell_fee_amount = order_sell_asset.amount * sell_fee / 100;
-            double buy_fee_amount = order_buy_asset.amount * buy_fee / 100;
-            asset order_sell_fee = eosio::asset(ceil(sell_fee_amount), order_sell_asset.symbol);
-            asset order_buy_fee = eosio::asset(ceil(buy_fee_amount), order_buy_asset.symbol);
+    // only accounts that have deposited get a settlement row
+    bool found = false;
+    for(auto token_itr = config().permitted_tokens.begin(); token_itr != config().permitted_tokens.end() && !found; token_itr++) {
+        balance_index balances(_self, token_itr->first.code().raw());
+        found = balances.find(owner.value) != balances.end();
+    }
+    check(found, "no owner found");
 
-            eosio::print(" order_sell_fee=",order_sell_fee);
-            eosio::print(" order_buy_fee=",order_buy_fee);
+    auto itr = settlement.find(owner.value);
+    if(internal) {
+        check(itr == settlement.end(), "settlement is already internal");
+        settlement.emplace(_self, [&] (auto& s) {
+            s.account = owner;
+        });
+    }
+    else {
+        check(itr != settlement.end(), "settlement is not internal");
+        settlement.erase(itr);
+    }
+}
 
-            order_buy->update_average_price(order_buy_asset, order_sell_asset, order_buy_fee, true);
-            order_sell->update_average_price(order_sell_asset, order_buy_asset, order_sell_fee, false);
-    
-            send_order_tokens(order_buy->owner, order_sell->owner, order_sell_asset, order_sell_fee);
-            send_order_tokens(order_sell->owner, order_buy->owner, order_buy_asset, order_buy_fee);
-    
-            if(order_sell->sell == order_sell->paid)
-            {
-                eosio::print(" empty sell.");
-                order_to_history(*order_sell, CLOSED_NORMALLY);
-                order_sell = sell.erase(order_sell);
-                if(order_sell != sell.end())
-                    sell_min = order_sell->price;
-                empty_sell = true;                
-            }
-            else modify_orders_info(*order_sell);
-
-            if(order_buy->sell == order_buy->paid)
-            {
-                eosio::print(" empty buy.");
-                order_to_history(*order_buy, CLOSED_NORMALLY);
-                order_buy = buy.erase(order_buy);
-                empty_buy = true;                
-            }
-            else modify_orders_info(*order_buy);
-
-            check(empty_sell || empty_buy, "error no empty order");
-
-            if(!empty_sell || !empty_buy) {
-                auto order_itr = order_sell;
-                std::list<Order>* orders_list = &sell;
-                if(!empty_buy) {
-                    eosio::print(" have order_buy yet.");
-                    order_itr = order_buy;
-                    orders_list = &buy;
-                }
-                else
-                    eosio::print(" have order_sell yet.");
-
-                asset order_balance = order_itr->sell - order_itr->paid;
-
-                if(order_balance < gstate.fee[order_itr->sell.symbol].min_order) {
-                    eosio::print(" order too small.");
-                    order_to_history(*order_itr, CLOSED_BY_MINIMUM_ORDER_SIZE);
-                    accounts.modify(accounts.find(order_itr->owner.value), _self, [&](auto& acnt){
-                        acnt.balances[order_balance.symbol].used -= order_balance;
-                    });
-                    send_transfer(order_itr->owner, order_balance, memos[CLOSED_BY_MINIMUM_ORDER_SIZE]);
-                    order_itr = orders_list->erase(order_itr);
-                    if( !empty_sell ) {
-                        order_sell = order_itr;
-                        if(order_itr != orders_list->end())
-                            sell_min = order_itr->price;
-                    }
-                    else{
-                        order_buy = order_itr;
-                        empty_buy = true;
-                    }
-                }
-            }
+// anyone can claim, the fees only go to the fee accounts
+void dexchange::claimfees() {
+    bool paid = false;
+    for(auto itr = fees.begin(); itr != fees.end(); itr++) {
+        paid = paid || itr->amount.amount != 0;
+        pay_fees(itr);
+    }
+    check(paid, "no fees to claim");
+}
 
-            empty_sell = false;
-            update_buckets(order_sell_asset, order_buy_asset, maker_order.price);
+const Book_order& get_maker(const Book_order& a, const Book_order& b) {
 
-            if(empty_buy)
-                break;
+    if (a.start_time < b.start_time)
+        return a;
+    if (b.start_time < a.start_time)
+        return b;
+    if (a.total_id < b.total_id)
+        return a;
+    return b;
+}
+
+// the info row is not written here, a maker closed by the fill only goes to the history
+Order dexchange::fill_order(const Book_order& b, const asset& r, const asset& p, const asset& fee, bool convert) {
+    Order order = all_orders_info.get(b.total_id, "order info not found");
+    order.update_average_price(r, p, fee, convert);
+    return order;
+}
+
+void dexchange::close_order(const Order& o, const uint16_t reason) {
+    asset order_balance = o.sell - o.paid;
+
+    order_to_history(o, reason);
+    balance_cache.debit_used(o.owner, order_balance);
+    send_transfer(o.owner, order_balance, memos[reason]);
+}
+
+// matches an incoming order against the opposite side of the book, see match_orders.
+// only makers are written, the taker is kept in memory and fills are collected in candles.
+// fills count against fills_left of the action. returns MATCH_END.
+uint8_t dexchange::matching(const Pair_info& pair, Order_book& book, Candle_aggregator& candles, Order& taker, const uint8_t side, const uint64_t ticks)
+{
+    // buy orders receive the pair sell token, sell orders the pair buy token
+    const Fee_info& buy_fee_info = fee_info(pair.sell);
+    const Fee_info& sell_fee_info = fee_info(pair.buy);
+
+    Match_terms terms;
+    terms.tick_size = pair.tick_size;
+    terms.taker_fee = fee_rate(side == SIDE_BUY ? buy_fee_info.taker_fee : sell_fee_info.taker_fee);
+    terms.maker_fee = fee_rate(side == SIDE_BUY ? sell_fee_info.maker_fee : buy_fee_info.maker_fee);
+    terms.maker_min_order = fee_info(taker.buy.symbol).min_order.amount;
+
+    // the book and the tables of the contract as the storage of match_orders
+    struct Market {
+        using iterator = Order_book::const_iterator;
+
+        dexchange&          contract;
+        const Pair_info&    pair;
+        Order_book&         book;
+        Candle_aggregator&  candles;
+        Order&              taker;
+        const uint8_t       side;
+        std::optional<Order> maker_info; // of the maker of the last fill, written back only if it stays
+
+        iterator best(const uint8_t maker_side) { return book.best(maker_side); }
+        bool     at_end(const iterator& itr) const { return itr == book.end(); }
+        uint64_t ticks(const iterator& itr) const { return itr->ticks; }
+        int64_t  left(const iterator& itr) const { return itr->sell_left().amount; }
+
+        void fill(const iterator& maker, const Deal& deal) {
+            asset base_asset = asset(deal.base, pair.sell);
+            asset quote_asset = asset(deal.quote, pair.buy);
+
+            const asset& taker_received = side == SIDE_BUY ? base_asset : quote_asset;
+            const asset& maker_received = side == SIDE_BUY ? quote_asset : base_asset;
+            asset taker_fee_asset = asset(deal.taker_fee, taker_received.symbol);
+            asset maker_fee_asset = asset(deal.maker_fee, maker_received.symbol);
+
+            taker.update_average_price(taker_received, maker_received, taker_fee_asset, side == SIDE_BUY);
+            maker_info = contract.fill_order(*maker, maker_received, taker_received, maker_fee_asset, side == SIDE_SELL);
+
+            contract.send_order_tokens(taker.owner, maker_info->owner, maker_received, maker_fee_asset);
+            contract.send_order_tokens(maker_info->owner, taker.owner, taker_received, taker_fee_asset);
+
+            action{
+                permission_level{contract.get_self(), "active"_n},
+                contract.get_self(),
+                "fillevent"_n,
+                std::make_tuple(Fill_event{ FILL_EVENT_VERSION, pair.key, maker->total_id, taker.total_id, maker_info->owner, taker.owner,
+                                            side, deal.ticks, pair.tick_size, base_asset, quote_asset, maker_fee_asset, taker_fee_asset })
+            }.send();
+
+            candles.add(quote_asset, base_asset, ticks_to_double(deal.ticks, pair.tick_size, pair.buy.precision(), pair.sell.precision()));
         }
-    }
 
-    all_orders.modify(all_orders.find(table_key), _self, [&] (auto& table){
-            table.sell_orders = sell;
-            table.buy_orders =  buy;
-    });
+        void close_maker(const iterator& maker, const uint8_t reason) {
+            Order info = maker_info.has_value() ? *maker_info : contract.all_orders_info.get(maker->total_id, "order info not found");
+            maker_info.reset();
+            book.erase(maker);
+
+            if(reason == MAKER_FILLED)
+                contract.order_to_history(info, CLOSED_NORMALLY);
+            else
+                contract.close_order(info, CLOSED_BY_MINIMUM_ORDER_SIZE);
+        }
+
+        void keep_maker(const iterator& maker, const int64_t left) {
+            book.update(maker, maker_info->paid);
+            contract.all_orders_info.modify(contract.all_orders_info.find(maker->total_id), contract.get_self(), [&] (auto& o) {
+                o = *maker_info;
+            });
+            maker_info.reset();
+        }
+    };
+
+    Market market{ *this, pair, book, candles, taker, side };
+    int64_t taker_left = (taker.sell - taker.paid).amount;
+    return match_orders(market, terms, side, ticks, taker_left, fills_left);
 }
 
-void dexchange::drop_orders_common(std::map<uint64_t, std::set<Order>>& orders_by_pairs, std::map< name, std::map<symbol, asset>> assets_to_transfer,
-                                    const uint16_t reason) {
-    
-    erase_by_pair_orders(orders_by_pairs, reason);
+// only orders still in their book are refunded, so an order listed twice is refunded once
+void dexchange::drop_orders_common(const std::map<uint64_t, std::vector<Order>>& orders_by_pairs, const uint16_t reason) {
 
-    for(auto account_itr = assets_to_transfer.begin(); account_itr != assets_to_transfer.end(); account_itr++) {
-        accounts.modify(accounts.find(account_itr->first.value), _self, [&](auto& acnt){
-            for(auto balance_itr = account_itr->second.begin(); balance_itr != account_itr->second.end(); balance_itr++) {
-                acnt.balances[balance_itr->first].used -= balance_itr->second;
-            }
-        });
+    std::map<name, std::map<symbol, asset>> assets_to_transfer;
+    erase_by_pair_orders(orders_by_pairs, reason, &assets_to_transfer);
 
-        for(auto balance_itr = account_itr->second.begin(); balance_itr != account_itr->second.end(); balance_itr++)
+    for(auto account_itr = assets_to_transfer.begin(); account_itr != assets_to_transfer.end(); account_itr++) {
+        for(auto balance_itr = account_itr->second.begin(); balance_itr != account_itr->second.end(); balance_itr++) {
+            balance_cache.debit_used(account_itr->first, balance_itr->second);
             send_transfer(account_itr->first, balance_itr->second, memos[reason]);
+        }
     }
+
+    balance_cache.flush();
 }
 
 void dexchange::insert_assets_to_transfer(const Order& order, std::map<name, std::map<symbol, asset>>& assets_to_transfer) {
@@ -545,179 +1041,183 @@ void dexchange::insert_assets_to_transfer(const Order& order, std::map<name, std
 void dexchange::droporders(const name& owner, std::vector<uint64_t> orders_ids) {
     require_auth(owner);
     check(blacklist.find(owner.value) == blacklist.end(), "This account has been blacklisted");
-    auto account_itr = accounts.find(owner.value);
-    check(account_itr != accounts.end(), "no owner found");
+    check_orders_migrated();
 
-    std::map<uint64_t, std::set<Order>> orders_by_pairs;
-    std::map< name, std::map<symbol, asset>> assets_to_transfer;
-    auto id_index = all_orders_info.get_index<"byid"_n>();
+    std::map<uint64_t, std::vector<Order>> orders_by_pairs;
 
     for(uint64_t id: orders_ids) {
-        auto order_itr = id_index.find(id);
-        if(order_itr != id_index.end() && order_itr->owner == owner) {
-            orders_by_pairs[order_itr->sell.symbol.raw()^order_itr->buy.symbol.raw()].insert(*order_itr);
-            insert_assets_to_transfer(*order_itr, assets_to_transfer);
+        auto order_itr = all_orders_info.find(id);
+        if(order_itr != all_orders_info.end() && order_itr->owner == owner) {
+            orders_by_pairs[pair_key(order_itr->sell.symbol, order_itr->buy.symbol)].push_back(*order_itr);
         }
     }
 
-    drop_orders_common(orders_by_pairs, assets_to_transfer, CLOSED_BY_USER);
+    drop_orders_common(orders_by_pairs, CLOSED_BY_USER);
 }
 
 void dexchange::dropsmallorders(const symbol& s) {  
     
-    std::map<uint64_t, std::set<Order>> orders_by_pairs;
-    std::map<name, std::map<symbol,asset>> assets_to_transfer;
+    check_orders_migrated();
+
+    std::map<uint64_t, std::vector<Order>> orders_by_pairs;
 
     auto size_index = all_orders_info.get_index<"byordersize"_n>();
     auto order_itr = size_index.begin();
 
-    eosio::print(" order_min=", gstate.fee[s].min_order);
+    const asset& min_order = fee_info(s).min_order;
+    eosio::print(" order_min=", min_order);
     
     for(order_itr = size_index.begin(); order_itr != size_index.end(); order_itr++) {
         if(order_itr->sell.symbol != s)
             continue;
         eosio::print(" size = ", order_itr->sell - order_itr->paid);
         
-        if((order_itr->sell - order_itr->paid) >= gstate.fee[s].min_order)
+        if((order_itr->sell - order_itr->paid) >= min_order)
             break;
 
         if(order_itr->sell.symbol != s)
             continue;
 
-        orders_by_pairs[order_itr->sell.symbol.raw()^order_itr->buy.symbol.raw()].insert(*order_itr);
-
-        insert_assets_to_transfer(*order_itr, assets_to_transfer);
+        orders_by_pairs[pair_key(order_itr->sell.symbol, order_itr->buy.symbol)].push_back(*order_itr);
     }
 
-    drop_orders_common(orders_by_pairs, assets_to_transfer, CLOSED_BY_MINIMUM_ORDER_SIZE);
+    drop_orders_common(orders_by_pairs, CLOSED_BY_MINIMUM_ORDER_SIZE);
 }
 
 void dexchange::dropall(const name& owner) {
     require_auth(owner);
     check(blacklist.find(owner.value) == blacklist.end(), "This account has been blacklisted");
-    auto account_itr = accounts.find(owner.value);
-    check(account_itr != accounts.end(), "no owner found");
+    check_orders_migrated();
 
-    std::map<uint64_t, std::set<Order>> orders_by_pairs;
-    std::map<name, std::map<symbol, asset>> assets_to_transfer;
+    std::map<uint64_t, std::vector<Order>> orders_by_pairs;
     auto owner_index = all_orders_info.get_index<"byowner"_n>();
-    auto order_itr = owner_index.lower_bound(account_itr->key);
+    auto order_itr = owner_index.lower_bound(owner.value);
 
-    while(order_itr->owner == owner) {
-        orders_by_pairs[order_itr->sell.symbol.raw()^order_itr->buy.symbol.raw()].insert(*order_itr);
-        insert_assets_to_transfer(*order_itr, assets_to_transfer);
+    while(order_itr != owner_index.end() && order_itr->owner == owner) {
+        orders_by_pairs[pair_key(order_itr->sell.symbol, order_itr->buy.symbol)].push_back(*order_itr);
         order_itr++;
     }
 
-    drop_orders_common(orders_by_pairs, assets_to_transfer, CLOSED_BY_USER);
+    drop_orders_common(orders_by_pairs, CLOSED_BY_USER);
 }
 
 void dexchange::init() {
     require_auth(_self);
-    global.set(gstate, _self);
+    global.set(config(), _self);
 }
 
 void dexchange::send_transfer(const name& to, const asset& quantity, const std::string& memo) {
     action{
         permission_level{_self, "active"_n},
-        eosio::name(gstate.permitted_tokens[quantity.symbol]),
+        eosio::name(config().permitted_tokens[quantity.symbol]),
         "transfer"_n,                
         std::make_tuple( _self, to, quantity, memo)
     }.send();
 }
 
-void dexchange::erase_all_pair_orders(const Orders& orders, const uint16_t reason) {
+// cancels orders of the pair until max_rows rows are processed, returns true if none is left
+bool dexchange::erase_all_pair_orders(const uint64_t pair_key, const uint16_t reason, const uint32_t max_rows, uint32_t& processed) {
 
-    std::map<name, std::pair<asset, asset>> to_transfer;
+    check_pair_migrated(pair_key);
 
-    for(auto sell_itr = orders.sell_orders.begin(); sell_itr != orders.sell_orders.end(); sell_itr++) {
-        order_to_history(*sell_itr, reason);
-                
-        if(to_transfer.find(sell_itr->owner) == to_transfer.end()) {
-            to_transfer[sell_itr->owner].first = sell_itr->sell - sell_itr->paid;
-            to_transfer[sell_itr->owner].second = asset(0, orders.buy);
-        }
-        else
-            to_transfer[sell_itr->owner].first += sell_itr->sell - sell_itr->paid;
-    }
+    Order_book book(_self, pair_key);
+    std::map<name, std::map<symbol, asset>> to_transfer;
 
-    for(auto buy_itr = orders.buy_orders.begin(); buy_itr != orders.buy_orders.end(); buy_itr++) {
-        order_to_history(*buy_itr, reason);
-                
-        if(to_transfer.find(buy_itr->owner) == to_transfer.end()) {
-            to_transfer[buy_itr->owner].second = buy_itr->sell - buy_itr->paid;
-            to_transfer[buy_itr->owner].first = asset(0, orders.sell);
-        }
+    auto book_itr = book.begin();
+    for(; book_itr != book.end() && processed < max_rows; processed++) {
+        order_to_history(all_orders_info.get(book_itr->total_id, "order info not found"), reason);
+
+        asset left = book_itr->sell_left();
+        if(to_transfer[book_itr->owner].find(left.symbol) == to_transfer[book_itr->owner].end())
+            to_transfer[book_itr->owner][left.symbol] = left;
         else
-            to_transfer[buy_itr->owner].second += buy_itr->sell - buy_itr->paid;
+            to_transfer[book_itr->owner][left.symbol] += left;
+
+        book_itr = book.erase(book_itr);
     }
 
     for(auto to_transfer_itr = to_transfer.begin(); to_transfer_itr != to_transfer.end(); to_transfer_itr++) {
-        accounts.modify(accounts.find(to_transfer_itr->first.value), _self, [&] (auto& acnt){
-            if(to_transfer_itr->second.first.amount != 0)
-                acnt.balances[to_transfer_itr->second.first.symbol].used -= to_transfer_itr->second.first;
-            if(to_transfer_itr->second.second.amount != 0)
-                acnt.balances[to_transfer_itr->second.second.symbol].used -= to_transfer_itr->second.second;
-        });
-        if(to_transfer_itr->second.first.amount != 0)
-            send_transfer(to_transfer_itr->first, to_transfer_itr->second.first, memos[reason]);
-        if(to_transfer_itr->second.second.amount != 0)
-            send_transfer(to_transfer_itr->first, to_transfer_itr->second.second, memos[reason]);
+        for(auto balance_itr = to_transfer_itr->second.begin(); balance_itr != to_transfer_itr->second.end(); balance_itr++) {
+            balance_cache.debit_used(to_transfer_itr->first, balance_itr->second);
+            if(balance_itr->second.amount != 0)
+                send_transfer(to_transfer_itr->first, balance_itr->second, memos[reason]);
+        }
     }
+    balance_cache.flush();
+
+    return book_itr == book.end();
 }
 
-void dexchange::cancel_orders_by_token_pair( const symbol& a, const symbol& b, const uint16_t reason) {
+// the orders of the pair are canceled by continuejob, orders on the pair wait for it
+void dexchange::start_pair_job(const symbol& a, const symbol& b, const uint8_t type) {
+    const uint64_t key = pair_key(a, b);
+    check_no_job(pairs.get(key));
 
-    auto itr_orders = all_orders.find(a.raw()^b.raw());
-    erase_all_pair_orders(*itr_orders, reason);
-    all_orders.erase(itr_orders);
+    Job job{};
+    job.type = type;
+    job.stage = STAGE_CANCEL_ORDERS;
+    job.cursor = key;
+    add_job(job);
 }
 
-void dexchange::cancel_orders_by_token( const symbol& s, const uint16_t reason) {
-    
-    for(auto itr_orders = all_orders.begin(); itr_orders != all_orders.end(); ) {
+// every visited pair and canceled order is a row. cursor is the pair to continue from
+// a pair of the token is charged by its orders only, so the cursor pair always loses an order
+// when rows are left. other pairs and empty books are charged one row for the visit
+bool dexchange::cancel_orders_by_token( const symbol& s, const uint16_t reason, uint64_t& cursor, const uint32_t max_rows, uint32_t& processed) {
+
+    for(auto pair_it = pairs.lower_bound(cursor); pair_it != pairs.end(); pair_it++) {
+        cursor = pair_it->key;
+        if(processed >= max_rows)
+            return false;
 
-        if(itr_orders->sell != s && itr_orders->buy != s) {
-            itr_orders++;
+        if(pair_it->sell != s && pair_it->buy != s) {
+            processed++;
             continue;
         }
 
-        erase_all_pair_orders(*itr_orders, reason);
-        itr_orders = all_orders.erase(itr_orders);
+        const uint32_t before = processed;
+        if(!erase_all_pair_orders(pair_it->key, reason, max_rows, processed)) {
+            check(processed > before, "no order canceled");
+            return false;
+        }
+        if(processed == before)
+            processed++;
     }
+    return true;
 }
 
 void dexchange::deltokenpair(const asset& a, const asset& b) {
     require_auth(_self);
+    start_pair_job(a.symbol, b.symbol, JOB_DELETE_PAIR);
+}
 
-    auto pair_it = gstate.permitted_pairs.end();
-    for(pair_it = gstate.permitted_pairs.begin(); pair_it != gstate.permitted_pairs.end(); pair_it++)
-        if( (pair_it->sell.raw()^pair_it->buy.raw()) == (a.symbol.raw()^b.symbol.raw()))
-            break;
-    check(pair_it != gstate.permitted_pairs.end(), "assets pair not found");
+void dexchange::remove_pair(const uint64_t pair_key) {
+    auto pair_itr = pairs.find(pair_key);
+    if(pair_itr == pairs.end())
+        return;
 
-    cancel_orders_by_token_pair(a.symbol, b.symbol, CLOSED_TOKEN_PAIR_DELETED);
+    rollup_index rollups(_self, _self.value);
+    auto rollup_itr = rollups.find(pair_key);
+    if(rollup_itr != rollups.end())
+        rollups.erase(rollup_itr);
 
-    gstate.permitted_pairs.erase(pair_it);
-    global.set(gstate, _self);
+    pair_key_cache.erase(pair_symbols(pair_itr->sell, pair_itr->buy));
+    pairs.erase(pair_itr);
 }
 
 void dexchange::addtokenpair(const asset& a, const asset& b) {
     require_auth(_self);
     check(a.symbol != b.symbol, "same tokens symbols");
-    check(gstate.permitted_tokens.find(a.symbol) != gstate.permitted_tokens.end(), "token not permitted");
-    check(gstate.permitted_tokens.find(b.symbol) != gstate.permitted_tokens.end(), "token not permitted");
-    auto p = gstate.pair_permitted(a, b);
-    check(!p.has_value(), "such a pair already exists");
-
-    Pair_info pair_info{ a.symbol, b.symbol, a.symbol.raw()^b.symbol.raw() };
-    gstate.permitted_pairs.push_back(pair_info);
-    global.set(gstate, _self);
-
-    for(auto itr = accounts.begin(); itr != accounts.end(); itr++)
-        accounts.modify(itr, _self, [&] (auto& acnt){
-            acnt.pairs_keys[std::pair(pair_info.sell, pair_info.buy)] = pair_info.key^acnt.key;
-        });
+    check(config().permitted_tokens.find(a.symbol) != config().permitted_tokens.end(), "token not permitted");
+    check(config().permitted_tokens.find(b.symbol) != config().permitted_tokens.end(), "token not permitted");
+    check(config().permitted_pairs.empty(), "pairs are not migrated yet");
+    check(!find_pair(a.symbol, b.symbol).has_value(), "such a pair already exists");
+    check(!deleting_token(a.symbol) && !deleting_token(b.symbol), "the token is being deleted");
+
+    Pair_info pair_info{ pairs.available_primary_key(), a.symbol, b.symbol };
+    pairs.emplace(_self, [&] (auto& p) {
+        p = pair_info;
+    });
 }
 
 Fee_info get_fee_info(const symbol& s, const double maker_fee, const double taker_fee) {
@@ -731,112 +1231,242 @@ Fee_info get_fee_info(const symbol& s, const double maker_fee, const double take
 void dexchange::addtoken(const name& contract, const symbol& s, const double maker_fee, const double taker_fee) {
     require_auth(_self);
     
-    for(auto it = gstate.permitted_tokens.begin(); it != gstate.permitted_tokens.end(); it++)
+    for(auto it = config().permitted_tokens.begin(); it != config().permitted_tokens.end(); it++)
         check(it->first.code() != s.code(), "token code exists");
 
     check( (0 <= maker_fee <= 100.0) && (0 <= taker_fee <= 100.0), "wrong fee");
 
-    gstate.permitted_tokens[s] = contract;
+    config().permitted_tokens[s] = contract;
     
-    gstate.fee[s] = get_fee_info(s, maker_fee, taker_fee);
+    config().fee[s] = get_fee_info(s, maker_fee, taker_fee);
+    fee_cache.clear();
 
-    if(gstate.token_contracts.find(contract) != gstate.token_contracts.end())
-        gstate.token_contracts[contract].symbols.insert(s);
+    if(config().token_contracts.find(contract) != config().token_contracts.end())
+        config().token_contracts[contract].symbols.insert(s);
     else {
         Symbols symbols;
         symbols.symbols.insert(s);
-        gstate.token_contracts[contract] = symbols;
+        config().token_contracts[contract] = symbols;
     }
 
-    global.set(gstate, _self);
+    global.set(config(), _self);
 }
 
-void dexchange::return_tokens(const eosio::symbol& s) {
+// every balance of the token is a row, returned balances are erased
+bool dexchange::return_tokens(const eosio::symbol& s, const uint32_t max_rows, uint32_t& processed) {
 
-    for(auto acnt_itr = accounts.begin(); acnt_itr != accounts.end(); acnt_itr++) {
-        auto token_itr = acnt_itr->balances.find(s);
-        if(token_itr == acnt_itr->balances.end())
-            continue;
+    balance_index balances(_self, s.code().raw());
+    for(auto itr = balances.begin(); itr != balances.end(); ) {
+        if(processed >= max_rows)
+            return false;
+        processed++;
 
-        asset quantity = token_itr->second.available + token_itr->second.used;
+        asset quantity = asset(itr->available + itr->used, s);
 
         if(quantity.amount != 0)
-            send_transfer(acnt_itr->owner, quantity, std::string("This token has been removed from the exchange"));
+            send_transfer(itr->owner, quantity, std::string("This token has been removed from the exchange"));
 
-        accounts.modify(acnt_itr, _self, [&] (auto& acnt){
-            acnt.balances.erase(s);
-        });
+        itr = balances.erase(itr);
     }
+    return true;
 }
 
 void dexchange::deltoken(const name& contract, const symbol& s) {
     require_auth(_self);
 
-    auto it = gstate.permitted_tokens.find(s);
-    check(it != gstate.permitted_tokens.end(), "token not found");
+    auto it = config().permitted_tokens.find(s);
+    check(it != config().permitted_tokens.end(), "token not found");
 
-    check(gstate.permitted_tokens[s] == contract, "symbol does not match the contract");
+    check(config().permitted_tokens[s] == contract, "symbol does not match the contract");
+    check(!deleting_token(s), "the token is being deleted");
+    check_accounts_migrated();
 
-    cancel_orders_by_token(s, CLOSED_TOKEN_DELETED);
+    // orders are canceled and balances returned by continuejob, the token is removed after them
+    Job job{};
+    job.type = JOB_DELETE_TOKEN;
+    job.stage = STAGE_CANCEL_ORDERS;
+    job.contract = contract;
+    job.token = s;
+    add_job(job);
+}
 
-    return_tokens(s);
+void dexchange::remove_token(const name& contract, const symbol& s) {
+    auto fee_itr = fees.find(s.code().raw());
+    if(fee_itr != fees.end()) {
+        pay_fees(fee_itr);
+        fees.erase(fee_itr);
+    }
 
-    gstate.fee.erase(s);
-    gstate.permitted_tokens.erase(it);
-    gstate.token_contracts[contract].symbols.erase(s);
-    if(gstate.token_contracts[contract].symbols.size() == 0)
-        gstate.token_contracts.erase(contract);
+    config().fee.erase(s);
+    fee_cache.clear();
+    config().permitted_tokens.erase(s);
+    config().token_contracts[contract].symbols.erase(s);
+    if(config().token_contracts[contract].symbols.size() == 0)
+        config().token_contracts.erase(contract);
 
-    global.set(gstate, _self);
+    global.set(config(), _self);
 }
 
 void dexchange::setfee(const symbol& s, const double maker_fee, const double taker_fee) {
     require_auth(_self);
-    check(gstate.fee.find(s) != gstate.fee.end(), "no such token");
+    check(config().fee.find(s) != config().fee.end(), "no such token");
     
-    gstate.fee[s] = get_fee_info(s, maker_fee, taker_fee);
-    global.set(gstate, _self);
+    config().fee[s] = get_fee_info(s, maker_fee, taker_fee);
+    fee_cache.clear();
+    global.set(config(), _self);
 
     dropsmallorders(s);
 }
 
 void dexchange::dropbytoken( const symbol& s) {
     require_auth(_self);
-    cancel_orders_by_token(s, CLOSED_BY_ADMIN);
+    check(config().permitted_tokens.find(s) != config().permitted_tokens.end(), "token not found");
+
+    Job job{};
+    job.type = JOB_DROP_BY_TOKEN;
+    job.stage = STAGE_CANCEL_ORDERS;
+    job.token = s;
+    add_job(job);
+}
+
+// orders read the job count instead of the jobs table, so every job is started here
+void dexchange::add_job(Job job) {
+    job.id = jobs.available_primary_key();
+    jobs.emplace(_self, [&] (auto& j) {
+        j = job;
+    });
+    counters().job_count.value()++;
+    save_counters();
+}
+
+bool Job::blocks(const Pair_info& pair) const {
+    if(type == JOB_DROP_BY_PAIR || type == JOB_DELETE_PAIR)
+        return cursor == pair.key;
+    return type == JOB_STOP_ROLLUP || token == pair.sell || token == pair.buy;
+}
+
+void dexchange::check_no_job(const Pair_info& pair) {
+    if(counters().job_count.value() == 0)
+        return;
+    for(auto itr = jobs.begin(); itr != jobs.end(); itr++)
+        check(!itr->blocks(pair), "a job is running on the pair");
+}
+
+bool dexchange::deleting_token(const symbol& s) {
+    if(counters().job_count.value() == 0)
+        return false;
+    for(auto itr = jobs.begin(); itr != jobs.end(); itr++)
+        if(itr->type == JOB_DELETE_TOKEN && itr->token == s)
+            return true;
+    return false;
+}
+
+bool dexchange::stopping_rollup() {
+    if(counters().job_count.value() == 0)
+        return false;
+    for(auto itr = jobs.begin(); itr != jobs.end(); itr++)
+        if(itr->type == JOB_STOP_ROLLUP)
+            return true;
+    return false;
+}
+
+// processes a slice of the job, returns true when it is done
+bool dexchange::run_job(Job& job, const uint32_t max_rows, uint32_t& processed) {
+    if(job.type == JOB_STOP_ROLLUP)
+        return stop_rollup(job, max_rows, processed);
+
+    if(job.type == JOB_DROP_BY_PAIR || job.type == JOB_DELETE_PAIR) {
+        const uint16_t reason = job.type == JOB_DELETE_PAIR ? CLOSED_TOKEN_PAIR_DELETED : CLOSED_BY_ADMIN;
+        if(!erase_all_pair_orders(job.cursor, reason, max_rows, processed))
+            return false;
+        if(job.type == JOB_DELETE_PAIR)
+            remove_pair(job.cursor);
+        return true;
+    }
+
+    if(job.stage == STAGE_CANCEL_ORDERS) {
+        const uint16_t reason = job.type == JOB_DELETE_TOKEN ? CLOSED_TOKEN_DELETED : CLOSED_BY_ADMIN;
+        if(!cancel_orders_by_token(job.token, reason, job.cursor, max_rows, processed))
+            return false;
+        if(job.type == JOB_DROP_BY_TOKEN)
+            return true;
+
+        job.stage = STAGE_RETURN_TOKENS;
+    }
+
+    if(!return_tokens(job.token, max_rows, processed))
+        return false;
+    remove_token(job.contract, job.token);
+    return true;
+}
+
+// anyone can continue the jobs, they were started by the admin. jobs run in the order they were started
+void dexchange::continuejob(const uint32_t max_rows) {
+    check(max_rows > 0, "wrong max rows");
+    auto itr = jobs.begin();
+    check(itr != jobs.end(), "no jobs");
+
+    uint32_t processed = 0;
+    while(itr != jobs.end() && processed < max_rows) {
+        Job job = *itr;
+        if(run_job(job, max_rows, processed)) {
+            itr = jobs.erase(itr);
+            counters().job_count.value()--;
+            save_counters();
+            continue;
+        }
+
+        jobs.modify(itr, _self, [&] (auto& j) {
+            j = job;
+        });
+        break;
+    }
+
+    eosio::print(" processed=", processed);
+}
+
+// permissionless, the fills are paid for by whoever pushes it
+void dexchange::crank(const symbol& a, const symbol& b, const uint32_t max_fills) {
+    check(max_fills > 0, "wrong max fills");
+    auto p = find_pair(a, b);
+    check(p.has_value(), "pair is not permitted");
+    check_pair_migrated(p->key);
+    check_no_job(*p);
+
+    Order_book book(_self, p->key);
+    check(book.first_pending() != book.end(), "no pending orders");
+
+    fills_left = std::min(max_fills, fill_limit());
+    Candle_aggregator candles(_self, p->key);
+    run_pending(*p, book, candles);
+    flush_candles(*p, candles);
+    balance_cache.flush();
 }
 
 void dexchange::dropbypair( const symbol& a, const symbol& b) {
     require_auth(_self);
-    cancel_orders_by_token_pair(a, b, CLOSED_BY_ADMIN);
+    start_pair_job(a, b, JOB_DROP_BY_PAIR);
 }
 
-void dexchange::erase_by_pair_orders(const std::map<uint64_t, std::set<Order>>& orders_by_pairs, const uint16_t reason) {
+// book rows are found by order id, so k orders are erased from a book of n in O(k log n)
+void dexchange::erase_by_pair_orders(const std::map<uint64_t, std::vector<Order>>& orders_by_pairs, const uint16_t reason,
+                                     std::map<name, std::map<symbol, asset>>* assets_to_transfer) {
 
     for(auto by_pairs_itr = orders_by_pairs.begin(); by_pairs_itr != orders_by_pairs.end(); by_pairs_itr++) {
-            
-        auto pair_itr = all_orders.find(by_pairs_itr->first);
-        std::list<Order> sell_orders = pair_itr->sell_orders;
-        std::list<Order> buy_orders = pair_itr->buy_orders;
-        std::list<Order>* orders;
+
+        check_pair_migrated(by_pairs_itr->first);
+        Order_book book(_self, by_pairs_itr->first);
 
         for(auto orders_itr = by_pairs_itr->second.begin(); orders_itr != by_pairs_itr->second.end(); orders_itr++) {
-            if(orders_itr->sell.symbol == pair_itr->sell)
-                orders = &sell_orders;
-            else
-                orders = &buy_orders;
-
-            for(auto itr_to_delete = orders->begin(); itr_to_delete != orders->end(); itr_to_delete++)
-                if(itr_to_delete->total_id == orders_itr->total_id) {
-                    order_to_history(*itr_to_delete, reason);
-                    orders->erase(itr_to_delete);
-                    break;
-                }
+            auto itr_to_delete = book.find(orders_itr->total_id);
+            if(itr_to_delete == book.end())
+                continue;
+
+            order_to_history(*orders_itr, reason);
+            book.erase(itr_to_delete);
+            if(assets_to_transfer)
+                insert_assets_to_transfer(*orders_itr, *assets_to_transfer);
         }
-
-        all_orders.modify(pair_itr, _self, [&] (auto& table){
-            table.sell_orders = sell_orders;
-            table.buy_orders = buy_orders;
-        });
     }
 }
 
@@ -844,28 +1474,37 @@ void dexchange::addblacklist(const name& account) {
     require_auth(_self);
     check(blacklist.find(account.value) == blacklist.end(), "account already blacklisted");
 
-    auto account_itr = accounts.find(account.value);
-    if(account_itr != accounts.end()) {
+    check_orders_migrated();
+    check_accounts_migrated();
 
-        std::map<uint64_t, std::set<Order>> orders_by_pairs;
-        auto owner_index = all_orders_info.get_index<"byowner"_n>();
-        auto order_itr = owner_index.lower_bound(account_itr->key);
+    std::map<uint64_t, std::vector<Order>> orders_by_pairs;
+    auto owner_index = all_orders_info.get_index<"byowner"_n>();
+    auto order_itr = owner_index.lower_bound(account.value);
 
-        while(order_itr->owner == account) {
-            orders_by_pairs[order_itr->sell.symbol.raw()^order_itr->buy.symbol.raw()].insert(*order_itr);
-            order_itr++;
-        }
+    while(order_itr != owner_index.end() && order_itr->owner == account) {
+        orders_by_pairs[pair_key(order_itr->sell.symbol, order_itr->buy.symbol)].push_back(*order_itr);
+        order_itr++;
+    }
 
-        erase_by_pair_orders(orders_by_pairs, CLOSED_ACCOUNT_BLACKLISTED);
+    erase_by_pair_orders(orders_by_pairs, CLOSED_ACCOUNT_BLACKLISTED);
 
-        for(auto balance_itr = account_itr->balances.begin(); balance_itr != account_itr->balances.end(); balance_itr++) {
-            asset quantity = balance_itr->second.available + balance_itr->second.used;
-            if(quantity.amount != 0)
-                send_transfer(account_itr->owner, quantity, std::string("This account has been blacklisted"));
-        }
-        accounts.erase(account_itr);
+    // the funds of canceled orders are still used, everything is returned at once
+    for(auto token_itr = config().permitted_tokens.begin(); token_itr != config().permitted_tokens.end(); token_itr++) {
+        balance_index balances(_self, token_itr->first.code().raw());
+        auto balance_itr = balances.find(account.value);
+        if(balance_itr == balances.end())
+            continue;
+
+        asset quantity = asset(balance_itr->available + balance_itr->used, token_itr->first);
+        if(quantity.amount != 0)
+            send_transfer(account, quantity, std::string("This account has been blacklisted"));
+        balances.erase(balance_itr);
     }
 
+    auto settlement_itr = settlement.find(account.value);
+    if(settlement_itr != settlement.end())
+        settlement.erase(settlement_itr);
+
     blacklist.emplace(_self, [&] (auto& acnt) {
         acnt.account = account;
         acnt.block_time = current_time_point();
@@ -892,53 +1531,369 @@ void dexchange::transfer(   const name&    from,
                 return;
 
     check(blacklist.find(from.value) == blacklist.end(), "This account has been blacklisted");
+    check(!deleting_token(quantity.symbol), "the token is being deleted");
+    check_accounts_migrated();
+
+    balance_cache.credit(from, quantity);
+    balance_cache.flush();
+}
+
+void dexchange::withdraw( const name& owner, const symbol& token) { 
+
+    require_auth(owner);
+    check(blacklist.find(owner.value) == blacklist.end(), "This account has been blacklisted");
+
+    check_accounts_migrated();
 
-    struct token_info balance;
-    balance.available = quantity;
-    balance.used = asset(0,quantity.symbol);
-
-    auto itr = accounts.find(from.value);
-    if(itr == accounts.end())
-    {
-        itr = accounts.emplace(_self, [&] (auto& acnt) {
-            acnt.owner = from;
-            acnt.key = from.value;
-            acnt.balances[quantity.symbol] = balance;
-            for(auto pair: gstate.permitted_pairs)
-                acnt.pairs_keys[std::pair(pair.sell, pair.buy)] = pair.key^acnt.key;
+    balance_index balances(_self, token.code().raw());
+    auto itr = balances.find(owner.value);
+    check(itr != balances.end(), "no such token balance");
+    check(itr->available != 0, "zero token balance");
+
+    send_transfer(owner, asset(itr->available, token), std::string("Token/tokens have been withdrawn"));
+
+    // nothing is left in orders either, the row is not needed
+    if(itr->used == 0)
+        balances.erase(itr);
+    else
+        balances.modify(itr, _self, [&] (auto& b){
+            b.available = 0;
+        });
+}
+
+void dexchange::addbucket(const uint32_t interval) {
+    require_auth(_self);
+    check(interval > 0, "wrong interval");
+
+    auto it = std::lower_bound(config().buckets.begin(), config().buckets.end(), interval);
+    check(it == config().buckets.end() || *it != interval, "such an interval already exists");
+    if(config().rollup_since.value_or(0) != 0)
+        check(it != config().buckets.begin(), "the finest interval can not change while candles are rolled up");
+
+    config().buckets.insert(it, interval);
+    if(config().rollup_since.value_or(0) != 0)
+        check_rollup_intervals(config().buckets);
+    global.set(config(), _self);
+}
+
+// candles already written for the interval stay in the table. with no interval left orders write
+// no candles, off-chain consumers can build them from fillevent
+void dexchange::delbucket(const uint32_t interval) {
+    require_auth(_self);
+
+    auto it = std::find(config().buckets.begin(), config().buckets.end(), interval);
+    check(it != config().buckets.end(), "interval not found");
+    if(config().rollup_since.value_or(0) != 0)
+        check(it != config().buckets.begin(), "the finest interval can not change while candles are rolled up");
+
+    config().buckets.erase(it);
+    global.set(config(), _self);
+}
+
+void dexchange::check_rollup_intervals(const std::vector<uint32_t>& intervals) {
+    check(!intervals.empty(), "no candle intervals");
+    for(uint32_t interval: intervals)
+        check(interval % intervals.front() == 0, "candle intervals must be multiples of the finest one");
+}
+
+uint32_t dexchange::rollup_candles(const uint64_t pair_key, Candle_aggregator& candles, const uint32_t until, const uint32_t max_candles) {
+    rollup_index rollups(_self, _self.value);
+    auto itr = rollups.find(pair_key);
+    uint32_t rolled_until = itr == rollups.end() ? config().rollup_since.value() : itr->rolled_until;
+
+    uint32_t rolled = candles.roll_up(config().buckets, rolled_until, until, max_candles);
+
+    if(itr == rollups.end()) {
+        rollups.emplace(_self, [&] (auto& r) {
+            r.pair_key = pair_key;
+            r.rolled_until = rolled_until;
         });
     }
-    else
-    {
-        accounts.modify(itr, _self, [&] (auto& acnt){
-            auto itr_balance = acnt.balances.find(quantity.symbol);
-            if(itr_balance == acnt.balances.end())
-                acnt.balances[quantity.symbol] = balance;
-            else
-                acnt.balances[quantity.symbol].available += quantity;
+    else if(itr->rolled_until != rolled_until) {
+        rollups.modify(itr, _self, [&] (auto& r) {
+            r.rolled_until = rolled_until;
         });
     }
+
+    return rolled;
 }
 
-void dexchange::withdraw( const name& owner, const symbol& token) { 
+// with rollup on, orders write only the finest candles and the coarser ones are rolled up
+// from them. it starts with the next finest candle, the current one is written everywhere
+void dexchange::setrollup(const bool enabled) {
+    require_auth(_self);
+    const uint32_t now = current_time_point().sec_since_epoch();
 
-    require_auth(owner);
-    check(blacklist.find(owner.value) == blacklist.end(), "This account has been blacklisted");
+    if(enabled) {
+        check(config().rollup_since.value_or(0) == 0, "candles are already rolled up");
+        check_rollup_intervals(config().buckets);
 
-    auto itr = accounts.find(owner.value);
-    check(itr != accounts.end(), "no such account");
+        const uint32_t finest = config().buckets.front();
+        config().rollup_since.emplace(now / finest * finest + finest);
+        global.set(config(), _self);
+        return;
+    }
 
-    auto balance = itr->balances.find(token);
-    check(balance != itr->balances.end(), "no such token balance");
-    check(balance->second.available.amount != 0, "zero token balance");
+    check(config().rollup_since.value_or(0) != 0, "candles are not rolled up");
+    check(!stopping_rollup(), "rollup is being stopped");
 
-    send_transfer(owner, balance->second.available, std::string("Token/tokens have been withdrawn"));
+    // candles of every pair are rolled up by continuejob, orders wait for it
+    Job job{};
+    job.type = JOB_STOP_ROLLUP;
+    job.stage = STAGE_ROLLUP_CANDLES;
+    add_job(job);
+}
 
-    accounts.modify(itr, _self, [&] (auto& acnt){
-        acnt.balances[token].available.amount = 0;
+// what is left, the current finest candle included, is rolled up before orders write every
+// interval again. a rolled candle, a finished pair and a cleared rollup row are a row each
+bool dexchange::stop_rollup(Job& job, const uint32_t max_rows, uint32_t& processed) {
+    const uint32_t now = current_time_point().sec_since_epoch();
+
+    if(job.stage == STAGE_ROLLUP_CANDLES) {
+        if(config().rollup_active(now)) {
+            const uint32_t finest = config().buckets.front();
+            for(auto pair_itr = pairs.lower_bound(job.cursor); pair_itr != pairs.end(); pair_itr++) {
+                job.cursor = pair_itr->key;
+                if(processed >= max_rows)
+                    return false;
+
+                Candle_aggregator candles(_self, pair_itr->key);
+                const uint32_t rows_left = max_rows - processed;
+                const uint32_t rolled = rollup_candles(pair_itr->key, candles, now / finest * finest + finest, rows_left);
+                processed += rolled;
+                if(rolled == rows_left)
+                    return false;
+                processed++;
+            }
+        }
+        job.stage = STAGE_CLEAR_ROLLUPS;
+    }
+
+    rollup_index rollups(_self, _self.value);
+    for(auto itr = rollups.begin(); itr != rollups.end(); processed++) {
+        if(processed >= max_rows)
+            return false;
+        itr = rollups.erase(itr);
+    }
+
+    config().rollup_since.emplace(0);
+    global.set(config(), _self);
+    return true;
+}
+
+// anyone can roll up the candles of a pair
+void dexchange::rollup(const symbol& a, const symbol& b, const uint32_t max_candles) {
+    const uint32_t now = current_time_point().sec_since_epoch();
+    check(config().rollup_active(now), "candles are not rolled up");
+    check(!stopping_rollup(), "rollup is being stopped");
+
+    const uint64_t key = pair_key(a, b);
+    const uint32_t finest = config().buckets.front();
+    Candle_aggregator candles(_self, key);
+
+    uint32_t rolled = rollup_candles(key, candles, now / finest * finest, max_candles);
+    check(rolled != 0, "nothing to roll up");
+    eosio::print(" rolled=", rolled);
+}
+
+void dexchange::settick(const symbol& a, const symbol& b, const uint64_t tick_size) {
+    require_auth(_self);
+    check(tick_size > 0, "wrong tick size");
+    const uint64_t key = pair_key(a, b);
+
+    check_pair_migrated(key);
+    Order_book book(_self, key);
+    check(book.empty(), "the pair has open orders");
+
+    pairs.modify(pairs.find(key), _self, [&] (auto& p) {
+        p.tick_size = tick_size;
     });
 }
 
+void dexchange::migratebook(const uint32_t max_orders) {
+    require_auth(_self);
+
+    auto pair_itr = all_orders.begin();
+    check(pair_itr != all_orders.end(), "nothing to migrate");
+
+    Order_book book(_self, pair_itr->primary_key());
+    const uint64_t tick_size = pairs.get(pair_itr->primary_key(), "pairs are not migrated yet").tick_size;
+    std::list<Order> sell_orders = pair_itr->sell_orders;
+    std::list<Order> buy_orders = pair_itr->buy_orders;
+    uint32_t moved = 0;
+
+    for(std::list<Order>* orders: {&sell_orders, &buy_orders}) {
+        while(!orders->empty() && moved < max_orders) {
+            const Order& o = orders->front();
+            if(book.find(o.total_id) == book.end()) {
+                const uint64_t ticks = order_ticks(pair_itr->sell, tick_size, o.sell, o.buy);
+                book.insert(o, orders == &sell_orders ? SIDE_SELL : SIDE_BUY, ticks);
+            }
+            orders->pop_front();
+            moved++;
+        }
+    }
+
+    eosio::print(" migrated=", moved);
+
+    if(sell_orders.empty() && buy_orders.empty())
+        all_orders.erase(pair_itr);
+    else
+        all_orders.modify(pair_itr, _self, [&] (auto& table){
+            table.sell_orders = sell_orders;
+            table.buy_orders = buy_orders;
+        });
+}
+
+// moves the pairs kept in globalstate into the pairs table. a pair keeps its key,
+// so the scope of its order book does not change
+void dexchange::migratepairs() {
+    require_auth(_self);
+    check(!config().permitted_pairs.empty(), "nothing to migrate");
+
+    for(auto& pair: config().permitted_pairs) {
+        pairs.emplace(_self, [&] (auto& p) {
+            p.key = pair.key;
+            p.sell = pair.sell;
+            p.buy = pair.buy;
+        });
+    }
+
+    eosio::print(" migrated=", config().permitted_pairs.size());
+
+    config().permitted_pairs.clear();
+    global.set(config(), _self);
+}
+
+// moves the balances kept in account rows to one row per token and account. balance
+// actions are refused until no account row is left
+void dexchange::migrateaccts(const uint32_t max_rows) {
+    require_auth(_self);
+
+    legacy_account_index legacy_accounts(_self, _self.value);
+    uint32_t moved = 0;
+
+    for(auto itr = legacy_accounts.begin(); itr != legacy_accounts.end() && moved < max_rows; moved++) {
+        for(auto balance_itr = itr->balances.begin(); balance_itr != itr->balances.end(); balance_itr++) {
+            balance_index balances(_self, balance_itr->first.code().raw());
+            balances.emplace(_self, [&] (auto& b) {
+                b.owner = itr->owner;
+                b.available = balance_itr->second.available.amount;
+                b.used = balance_itr->second.used.amount;
+            });
+        }
+        itr = legacy_accounts.erase(itr);
+    }
+
+    check(moved != 0, "nothing to migrate");
+    eosio::print(" migrated=", moved);
+}
+
+template<typename T>
+uint32_t dexchange::migrate_buckets(T& legacy, uint32_t max_rows) {
+    uint32_t moved = 0;
+
+    for(auto itr = legacy.begin(); itr != legacy.end() && moved < max_rows; moved++) {
+        // candles of a deleted pair are dropped
+        auto p = find_pair(itr->base, itr->quote);
+        if(p.has_value()) {
+            bucket_index candles(_self, p->key);
+            auto candle_itr = candles.find(Bucket::candle_key(itr->bucket, itr->open));
+            if(candle_itr == candles.end()) {
+                candles.emplace(_self, [&] (auto& b) {
+                    b.bucket = itr->bucket;
+                    b.open = itr->open;
+                    b.base = itr->base;
+                    b.quote = itr->quote;
+                    b.high_base = itr->high_base;
+                    b.low_base = itr->low_base;
+                    b.open_base = itr->open_base;
+                    b.close_base = itr->close_base;
+                    b.base_volume = itr->base_volume;
+                    b.quote_volume = itr->quote_volume;
+                });
+            }
+            else {
+                // the candle was continued after the upgrade, the legacy row is the older part of it
+                candles.modify(candle_itr, _self, [&] (auto& b) {
+                    b.high_base = std::max(b.high_base, itr->high_base);
+                    b.low_base = std::min(b.low_base, itr->low_base);
+                    b.open_base = itr->open_base;
+                    b.base_volume += itr->base_volume;
+                    b.quote_volume += itr->quote_volume;
+                });
+            }
+        }
+        itr = legacy.erase(itr);
+    }
+
+    return moved;
+}
+
+// moves rows of the tables keyed by xor of their fields to the tables with exact keys.
+// open orders go first, order actions are refused until none is left in ordersinfo
+void dexchange::migratekeys(const uint32_t max_rows) {
+    require_auth(_self);
+    check(config().permitted_pairs.empty(), "pairs are not migrated yet");
+
+    legacy_orders_info_index legacy_info(_self, _self.value);
+    legacy_history_index legacy_history(_self, _self.value);
+    uint32_t moved = 0;
+
+    for(auto itr = legacy_info.begin(); itr != legacy_info.end() && moved < max_rows; moved++) {
+        all_orders_info.emplace(_self, [&] (auto& o) {
+            o.total_id = itr->total_id;
+            o.owner = itr->owner;
+            o.price = itr->price;
+            o.start_time = itr->start_time;
+            o.sell = itr->sell;
+            o.buy = itr->buy;
+            o.received = itr->received;
+            o.paid = itr->paid;
+            o.fee = itr->fee;
+            o.average_price = itr->average_price;
+        });
+        itr = legacy_info.erase(itr);
+    }
+
+    for(auto itr = legacy_history.begin(); itr != legacy_history.end() && moved < max_rows; moved++) {
+        orders_history.emplace(_self, [&] (auto& h) {
+            h.total_id = itr->total_id;
+            h.close_status = itr->close_status;
+            h.owner = itr->owner;
+            h.start_time = itr->start_time;
+            h.end_time = itr->end_time;
+            h.sell = itr->sell;
+            h.buy = itr->buy;
+            h.received = itr->received;
+            h.paid = itr->paid;
+            h.fee = itr->fee;
+            h.price = itr->price;
+            h.average_price = itr->average_price;
+        });
+        itr = legacy_history.erase(itr);
+    }
+
+    legacy_bucket_index1 legacy_buckets1(_self, _self.value);
+    legacy_bucket_index2 legacy_buckets2(_self, _self.value);
+    legacy_bucket_index3 legacy_buckets3(_self, _self.value);
+    legacy_bucket_index4 legacy_buckets4(_self, _self.value);
+    legacy_bucket_index5 legacy_buckets5(_self, _self.value);
+    legacy_bucket_index6 legacy_buckets6(_self, _self.value);
+    legacy_bucket_index7 legacy_buckets7(_self, _self.value);
+
+    moved += migrate_buckets(legacy_buckets1, max_rows - moved);
+    moved += migrate_buckets(legacy_buckets2, max_rows - moved);
+    moved += migrate_buckets(legacy_buckets3, max_rows - moved);
+    moved += migrate_buckets(legacy_buckets4, max_rows - moved);
+    moved += migrate_buckets(legacy_buckets5, max_rows - moved);
+    moved += migrate_buckets(legacy_buckets6, max_rows - moved);
+    moved += migrate_buckets(legacy_buckets7, max_rows - moved);
+
+    check(moved != 0, "nothing to migrate");
+    eosio::print(" migrated=", moved);
+}
+
 #undef EOSIO_DISPATCH
 
 #define EOSIO_DISPATCH( TYPE, MEMBERS ) \
@@ -972,7 +1927,14 @@ extern "C" { \
 
 EOSIO_DISPATCH(dexchange,   (transfer)
                             (withdraw)
+                            (setsettle)
+                            (claimfees)
+                            (continuejob)
+                            (crank)
                             (order)
+                            (placeorder)
+                            (placebatch)
+                            (amend)
                             (droporders)
                             (dropall)
                             (init)
@@ -985,4 +1947,18 @@ EOSIO_DISPATCH(dexchange,   (transfer)
                             (dropbypair)
                             (addblacklist)
                             (delblacklist)
+                            (addbucket)
+                            (delbucket)
+                            (setrollup)
+                            (rollup)
+                            (settick)
+                            (migratebook)
+                            (migratepairs)
+                            (migratekeys)
+                            (migrateaccts)
+                            (sethistory)
+                            (prunehist)
+                            (setmaxfills)
+                            (histlog)
+                            (fillevent)
                             )
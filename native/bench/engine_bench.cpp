@@ -0,0 +1,187 @@
+#include <memory_market.hpp>
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <vector>
+
+// Orders, fills and cancels per second of the in-memory book at depths from 10 to 100k orders
+// per side. Every benchmark reports allocs/op, counted over the timed part only.
+
+static std::atomic<uint64_t> allocations{0};
+
+// every replaceable form is replaced, so that each new is paired with a delete of this file
+namespace {
+
+void* counted_alloc(const std::size_t size, const std::size_t align = 0) {
+   allocations.fetch_add(1, std::memory_order_relaxed);
+   const std::size_t n = size ? size : 1;
+   return align ? std::aligned_alloc(align, (n + align - 1) / align * align) : std::malloc(n);
+}
+
+void* counted_new(const std::size_t size, const std::size_t align = 0) {
+   if(void* p = counted_alloc(size, align))
+      return p;
+   throw std::bad_alloc();
+}
+
+}
+
+void* operator new(std::size_t size) { return counted_new(size); }
+void* operator new[](std::size_t size) { return counted_new(size); }
+void* operator new(std::size_t size, std::align_val_t al) { return counted_new(size, std::size_t(al)); }
+void* operator new[](std::size_t size, std::align_val_t al) { return counted_new(size, std::size_t(al)); }
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept { return counted_alloc(size); }
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept { return counted_alloc(size); }
+void* operator new(std::size_t size, std::align_val_t al, const std::nothrow_t&) noexcept { return counted_alloc(size, std::size_t(al)); }
+void* operator new[](std::size_t size, std::align_val_t al, const std::nothrow_t&) noexcept { return counted_alloc(size, std::size_t(al)); }
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept { std::free(p); }
+
+namespace {
+
+// price 1.0, so that both sides trade whole amounts at every level
+const uint64_t MID_TICKS = PRICE_SCALE;
+const uint64_t LEVEL_TICKS = 1000000;
+const int64_t  ORDER_BASE = 1000000;
+const int64_t  SWEEP_FILLS = 10;
+
+Match_terms terms() {
+   Match_terms t;
+   t.tick_size = DEFAULT_TICK_SIZE;
+   t.taker_fee = fee_rate(0.2);
+   t.maker_fee = fee_rate(0.1);
+   t.maker_min_order = 0;
+   return t;
+}
+
+uint64_t ask_ticks(const int64_t level) { return MID_TICKS + (level + 1) * LEVEL_TICKS; }
+uint64_t bid_ticks(const int64_t level) { return MID_TICKS - (level + 1) * LEVEL_TICKS; }
+
+// one order of ORDER_BASE per level on each side, returns the ids of the bids
+std::vector<uint64_t> fill_book(Memory_market& market, const int64_t depth) {
+   std::vector<uint64_t> bids;
+   bids.reserve(depth);
+   for(int64_t level = 0; level < depth; level++) {
+      market.place(SIDE_SELL, ask_ticks(level), ORDER_BASE);
+      bids.push_back(market.place(SIDE_BUY, bid_ticks(level), quote_for_base(ORDER_BASE, bid_ticks(level))));
+   }
+   return bids;
+}
+
+// runs `rebuild` with the timer stopped and keeps its allocations out of allocs/op
+template<typename F>
+void untimed(benchmark::State& state, uint64_t& skipped, F&& rebuild) {
+   state.PauseTiming();
+   const uint64_t before = allocations.load(std::memory_order_relaxed);
+   rebuild();
+   skipped += allocations.load(std::memory_order_relaxed) - before;
+   state.ResumeTiming();
+}
+
+void report(benchmark::State& state, const uint64_t ops, const uint64_t start, const uint64_t skipped, const char* rate) {
+   const uint64_t allocs = allocations.load(std::memory_order_relaxed) - start - skipped;
+   state.SetItemsProcessed(ops);
+   state.counters[rate] = benchmark::Counter(double(ops), benchmark::Counter::kIsRate);
+   state.counters["allocs/op"] = ops ? double(allocs) / double(ops) : 0;
+   state.counters["depth"] = double(state.range(0));
+}
+
+// resting orders that do not cross, the book grows up to twice the depth and is rebuilt
+void BM_place(benchmark::State& state) {
+   const int64_t depth = state.range(0);
+   Memory_market market(terms());
+   std::mt19937_64 rng(1);
+   std::uniform_int_distribution<int64_t> level(0, depth - 1);
+   fill_book(market, depth);
+
+   uint64_t ops = 0, skipped = 0, placed = 0;
+   const uint64_t start = allocations.load(std::memory_order_relaxed);
+   for(auto _ : state) {
+      const int64_t l = level(rng);
+      if(ops & 1)
+         benchmark::DoNotOptimize(market.place(SIDE_SELL, ask_ticks(l), ORDER_BASE));
+      else
+         benchmark::DoNotOptimize(market.place(SIDE_BUY, bid_ticks(l), quote_for_base(ORDER_BASE, bid_ticks(l))));
+      ++ops;
+
+      if(++placed == uint64_t(depth) * 2) {
+         untimed(state, skipped, [&] { market.clear(); fill_book(market, depth); });
+         placed = 0;
+      }
+   }
+   report(state, ops, start, skipped, "orders/s");
+}
+
+// sell takers each taking SWEEP_FILLS whole bids, the bids are refilled once they run short
+void BM_sweep(benchmark::State& state) {
+   const int64_t depth = state.range(0);
+   const int64_t fills_per_taker = std::min<int64_t>(SWEEP_FILLS, depth);
+   Memory_market market(terms());
+   fill_book(market, depth);
+
+   int64_t bids_left = depth;
+   const uint64_t start = allocations.load(std::memory_order_relaxed);
+   const uint64_t fills_before = market.fills;
+   uint64_t skipped = 0;
+   for(auto _ : state) {
+      benchmark::DoNotOptimize(market.place(SIDE_SELL, 1, fills_per_taker * ORDER_BASE));
+      bids_left -= fills_per_taker;
+
+      if(bids_left < fills_per_taker) {
+         untimed(state, skipped, [&] { market.clear(); fill_book(market, depth); });
+         bids_left = depth;
+      }
+   }
+   report(state, market.fills - fills_before, start, skipped, "fills/s");
+}
+
+// cancels of random bids, the book is rebuilt once half of them are gone
+void BM_cancel(benchmark::State& state) {
+   const int64_t depth = state.range(0);
+   Memory_market market(terms());
+   std::mt19937_64 rng(1);
+   std::vector<uint64_t> bids = fill_book(market, depth);
+   std::shuffle(bids.begin(), bids.end(), rng);
+
+   uint64_t ops = 0, skipped = 0;
+   size_t next = 0;
+   const uint64_t start = allocations.load(std::memory_order_relaxed);
+   for(auto _ : state) {
+      benchmark::DoNotOptimize(market.cancel(bids[next++]));
+      ++ops;
+
+      if(next * 2 >= bids.size()) {
+         untimed(state, skipped, [&] {
+            market.clear();
+            bids = fill_book(market, depth);
+            std::shuffle(bids.begin(), bids.end(), rng);
+         });
+         next = 0;
+      }
+   }
+   report(state, ops, start, skipped, "cancels/s");
+}
+
+}
+
+BENCHMARK(BM_place)->RangeMultiplier(10)->Range(10, 100000);
+BENCHMARK(BM_sweep)->RangeMultiplier(10)->Range(10, 100000);
+BENCHMARK(BM_cancel)->RangeMultiplier(10)->Range(10, 100000);
+
+BENCHMARK_MAIN();
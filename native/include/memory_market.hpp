@@ -0,0 +1,117 @@
+#pragma once
+
+#include <dexchange/engine.hpp>
+
+#include <map>
+#include <tuple>
+#include <unordered_map>
+
+// In-memory storage for match_orders, ordered the way Order_book is:
+// best price first, then the older order.
+class Memory_market {
+   public:
+      struct Candle {
+         double high_base;
+         double low_base;
+         double open_base;
+         double close_base;
+         double base_volume;
+         double quote_volume;
+      };
+
+      struct Resting {
+         uint64_t ticks;
+         int64_t  left;
+      };
+
+      // side, price key (see price_key), id
+      typedef std::tuple<uint8_t, uint64_t, uint64_t> key;
+      typedef std::map<key, Resting> book_type;
+      typedef book_type::iterator iterator;
+
+      Memory_market(const Match_terms& terms, uint8_t base_precision = 8, uint8_t quote_precision = 8)
+         : terms(terms), base_precision(base_precision), quote_precision(quote_precision) {}
+
+      // matches an order selling `amount` (base for SIDE_SELL, quote for SIDE_BUY) and rests what is left.
+      // every order takes the next id like in the contract, whether it rests or not.
+      uint64_t place(const uint8_t side, const uint64_t ticks, int64_t amount) {
+         const uint64_t id = next_id++;
+         uint32_t fills_left = UINT32_MAX;
+         if(match_orders(*this, terms, side, ticks, amount, fills_left) != MATCH_DONE || amount == 0)
+            return id;
+
+         auto itr = orders.emplace(key{side, price_key(side, ticks), id}, Resting{ticks, amount}).first;
+         by_id.emplace(id, itr);
+         return id;
+      }
+
+      bool cancel(const uint64_t id) {
+         auto itr = by_id.find(id);
+         if(itr == by_id.end())
+            return false;
+         orders.erase(itr->second);
+         by_id.erase(itr);
+         return true;
+      }
+
+      bool resting(const uint64_t id) const { return by_id.find(id) != by_id.end(); }
+      size_t depth() const { return orders.size(); }
+
+      void clear() {
+         orders.clear();
+         by_id.clear();
+      }
+
+      // storage of match_orders
+      iterator best(const uint8_t side) {
+         best_side = side;
+         return orders.lower_bound(key{side, 0, 0});
+      }
+      bool     at_end(const iterator& itr) const { return itr == orders.end() || std::get<0>(itr->first) != best_side; }
+      uint64_t ticks(const iterator& itr) const { return itr->second.ticks; }
+      int64_t  left(const iterator& itr) const { return itr->second.left; }
+
+      void fill(const iterator&, const Deal& deal) {
+         const double price = ticks_to_double(deal.ticks, terms.tick_size, quote_precision, base_precision);
+         const double base = deal.base / pow10_double(base_precision);
+         const double quote = deal.quote / pow10_double(quote_precision);
+         if(fills == 0)
+            candle_open(candle, price, base, quote);
+         else
+            candle_update(candle, price, base, quote);
+
+         ++fills;
+         taker_fees += deal.taker_fee;
+         maker_fees += deal.maker_fee;
+      }
+
+      void close_maker(const iterator& maker, const uint8_t) {
+         by_id.erase(std::get<2>(maker->first));
+         orders.erase(maker);
+         ++closed;
+      }
+
+      void keep_maker(const iterator& maker, const int64_t left) {
+         maker->second.left = left;
+      }
+
+      uint64_t fills = 0;
+      uint64_t closed = 0;
+      int64_t  taker_fees = 0;
+      int64_t  maker_fees = 0;
+      Candle   candle = {};
+
+   private:
+      // buy orders are kept from the highest price
+      static uint64_t price_key(const uint8_t side, const uint64_t ticks) {
+         return side == SIDE_BUY ? ~ticks : ticks;
+      }
+
+      Match_terms terms;
+      uint8_t     base_precision;
+      uint8_t     quote_precision;
+      uint8_t     best_side = SIDE_SELL;
+      uint64_t    next_id = 0;
+      book_type   orders;
+      std::unordered_map<uint64_t, iterator> by_id;
+};
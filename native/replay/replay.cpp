@@ -0,0 +1,394 @@
+#include <memory_market.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Replays an order flow against the in-memory book and reports throughput, time per action,
+// book depth over time and the actions that would not fit into the CPU limit.
+//
+// The flow is a recorded log or a synthetic Poisson flow, one action per line:
+//    <ms> transfer   <owner> <quantity>
+//    <ms> order      <owner> <id> <sell> <buy>
+//    <ms> droporders <owner> <id> [<id> ...]
+//    <ms> dropall    <owner>
+// ids are the ones the orders got when recorded, droporders refers to them. scripts/replay.sh
+// replays the same log against a node.
+
+namespace {
+
+struct Asset {
+   int64_t     amount = 0;
+   uint8_t     precision = 0;
+   std::string symbol;
+};
+
+struct Action {
+   uint64_t              ms = 0;
+   std::string           name;
+   std::string           owner;
+   std::vector<uint64_t> ids;
+   Asset                 sell;
+   Asset                 buy;
+};
+
+struct Options {
+   std::string log;
+   std::string write;
+   std::string depth_out;
+   std::string base = "PBASE";
+   std::string quote = "PQUOTE";
+   double   rate = 100;            // synthetic actions per second of flow time
+   double   duration = 60;         // synthetic flow seconds
+   double   mid = 1.0;             // synthetic mid price
+   double   spread = 0.01;         // price deviation from mid, relative
+   std::string dist = "normal";    // normal or uniform
+   double   cancel_ratio = 0.3;
+   double   dropall_ratio = 0.01;
+   uint32_t accounts = 20;
+   uint64_t seed = 1;
+   double   target_rate = 0;       // replayed actions per second, 0 is as fast as possible
+   uint64_t cpu_limit_us = 30000;
+   uint64_t depth_every_ms = 1000;
+};
+
+void usage(const char* name) {
+   std::fprintf(stderr,
+      "Usage: %s [OPTION]...\n"
+      "  --log FILE            replay the recorded flow in FILE, otherwise a Poisson flow is generated\n"
+      "  --write FILE          write the flow to FILE\n"
+      "  --base SYM --quote SYM  symbols of the pair (default PBASE/PQUOTE)\n"
+      "  --rate N              synthetic actions per second (default 100)\n"
+      "  --duration S          synthetic flow seconds (default 60)\n"
+      "  --mid P               synthetic mid price (default 1.0)\n"
+      "  --spread F            relative price deviation from mid (default 0.01)\n"
+      "  --dist normal|uniform price distribution (default normal)\n"
+      "  --cancel-ratio F      share of droporders (default 0.3)\n"
+      "  --dropall-ratio F     share of dropall (default 0.01)\n"
+      "  --accounts N          synthetic accounts (default 20)\n"
+      "  --seed N\n"
+      "  --target-rate N       replayed actions per second, 0 is as fast as possible (default 0)\n"
+      "  --cpu-limit-us N      an action taking longer counts as failed (default 30000)\n"
+      "  --depth-every MS      book depth sample interval of flow time (default 1000)\n"
+      "  --depth-out FILE      write the depth samples as csv\n", name);
+   std::exit(1);
+}
+
+Options parse_options(int argc, char** argv) {
+   Options o;
+   for(int i = 1; i < argc; i++) {
+      std::string arg = argv[i];
+      if(i + 1 >= argc)
+         usage(argv[0]);
+      const char* value = argv[++i];
+      if(arg == "--log") o.log = value;
+      else if(arg == "--write") o.write = value;
+      else if(arg == "--depth-out") o.depth_out = value;
+      else if(arg == "--base") o.base = value;
+      else if(arg == "--quote") o.quote = value;
+      else if(arg == "--rate") o.rate = std::atof(value);
+      else if(arg == "--duration") o.duration = std::atof(value);
+      else if(arg == "--mid") o.mid = std::atof(value);
+      else if(arg == "--spread") o.spread = std::atof(value);
+      else if(arg == "--dist") o.dist = value;
+      else if(arg == "--cancel-ratio") o.cancel_ratio = std::atof(value);
+      else if(arg == "--dropall-ratio") o.dropall_ratio = std::atof(value);
+      else if(arg == "--accounts") o.accounts = std::strtoul(value, nullptr, 10);
+      else if(arg == "--seed") o.seed = std::strtoull(value, nullptr, 10);
+      else if(arg == "--target-rate") o.target_rate = std::atof(value);
+      else if(arg == "--cpu-limit-us") o.cpu_limit_us = std::strtoull(value, nullptr, 10);
+      else if(arg == "--depth-every") o.depth_every_ms = std::strtoull(value, nullptr, 10);
+      else usage(argv[0]);
+   }
+   if(o.rate <= 0 || o.accounts == 0 || o.depth_every_ms == 0 || (o.dist != "normal" && o.dist != "uniform"))
+      usage(argv[0]);
+   return o;
+}
+
+// "10.0000 PBASE"
+bool parse_asset(std::istream& in, Asset& a) {
+   std::string amount;
+   if(!(in >> amount >> a.symbol))
+      return false;
+   const size_t dot = amount.find('.');
+   a.precision = dot == std::string::npos ? 0 : amount.size() - dot - 1;
+   if(dot != std::string::npos)
+      amount.erase(dot, 1);
+   a.amount = std::strtoll(amount.c_str(), nullptr, 10);
+   return a.precision <= MAX_PRECISION;
+}
+
+std::string format_asset(const Asset& a) {
+   std::string digits = std::to_string(a.amount);
+   if(a.precision > 0) {
+      if(digits.size() <= a.precision)
+         digits.insert(0, a.precision + 1 - digits.size(), '0');
+      digits.insert(digits.size() - a.precision, ".");
+   }
+   return digits + " " + a.symbol;
+}
+
+std::vector<Action> read_log(const std::string& path) {
+   std::ifstream file(path);
+   if(!file) {
+      std::fprintf(stderr, "can not open %s\n", path.c_str());
+      std::exit(1);
+   }
+
+   std::vector<Action> flow;
+   std::string line;
+   size_t line_no = 0;
+   while(std::getline(file, line)) {
+      line_no++;
+      if(line.empty() || line[0] == '#')
+         continue;
+
+      std::istringstream in(line);
+      Action a;
+      bool ok = bool(in >> a.ms >> a.name >> a.owner);
+      if(ok && a.name == "transfer")
+         ok = parse_asset(in, a.sell);
+      else if(ok && a.name == "order") {
+         a.ids.emplace_back();
+         ok = bool(in >> a.ids.back()) && parse_asset(in, a.sell) && parse_asset(in, a.buy);
+      }
+      else if(ok && a.name == "droporders") {
+         for(uint64_t id; in >> id; )
+            a.ids.push_back(id);
+         ok = !a.ids.empty();
+      }
+      else if(ok && a.name != "dropall")
+         ok = false;
+
+      if(!ok) {
+         std::fprintf(stderr, "%s:%zu: can not parse \"%s\"\n", path.c_str(), line_no, line.c_str());
+         std::exit(1);
+      }
+      flow.push_back(std::move(a));
+   }
+   return flow;
+}
+
+void write_log(const std::string& path, const std::vector<Action>& flow) {
+   std::ofstream file(path);
+   file << "# <ms> transfer <owner> <quantity> | order <owner> <id> <sell> <buy> | droporders <owner> <id>... | dropall <owner>\n";
+   for(const Action& a: flow) {
+      file << a.ms << ' ' << a.name << ' ' << a.owner;
+      if(a.name == "transfer")
+         file << ' ' << format_asset(a.sell);
+      else if(a.name == "order")
+         file << ' ' << a.ids[0] << ' ' << format_asset(a.sell) << ' ' << format_asset(a.buy);
+      else
+         for(uint64_t id: a.ids)
+            file << ' ' << id;
+      file << '\n';
+   }
+}
+
+// traderaaa, traderaab, ...
+std::string account_name(const uint32_t i) {
+   const char* letters = "abcdefghijklmnopqrstuvwxyz";
+   return std::string("trader") + letters[i / 676 % 26] + letters[i / 26 % 26] + letters[i % 26];
+}
+
+// orders of 1 to 100 base units at a price drawn around mid, every account deposits both
+// tokens first. cancels pick one of the earlier orders of the account, which may be gone
+std::vector<Action> generate(const Options& o) {
+   const uint8_t precision = 4;
+   const double scale = pow10_double(precision);
+   std::mt19937_64 rng(o.seed);
+   std::exponential_distribution<double> gap(o.rate / 1000.0);
+   std::uniform_real_distribution<double> unit(0, 1);
+   std::normal_distribution<double> normal(0, o.spread);
+   std::uniform_int_distribution<uint32_t> account(0, o.accounts - 1);
+   std::uniform_int_distribution<int64_t> size(1, 100);
+
+   std::vector<Action> flow;
+   for(uint32_t i = 0; i < o.accounts; i++)
+      for(const std::string& s: {o.base, o.quote}) {
+         Action a;
+         a.name = "transfer";
+         a.owner = account_name(i);
+         a.sell = Asset{int64_t(1000000000 * scale), precision, s};
+         flow.push_back(a);
+      }
+
+   std::vector<std::vector<uint64_t>> placed(o.accounts);
+   uint64_t next_id = 0;
+   double ms = 0;
+   while((ms += gap(rng)) < o.duration * 1000) {
+      const uint32_t owner = account(rng);
+      const double r = unit(rng);
+      Action a;
+      a.ms = uint64_t(ms);
+      a.owner = account_name(owner);
+
+      if(r < o.dropall_ratio) {
+         a.name = "dropall";
+         placed[owner].clear();
+      }
+      else if(r < o.dropall_ratio + o.cancel_ratio && !placed[owner].empty()) {
+         a.name = "droporders";
+         std::uniform_int_distribution<size_t> pick(0, placed[owner].size() - 1);
+         const size_t i = pick(rng);
+         a.ids.push_back(placed[owner][i]);
+         placed[owner].erase(placed[owner].begin() + i);
+      }
+      else {
+         const double deviation = o.dist == "normal" ? normal(rng) : (unit(rng) * 2 - 1) * o.spread;
+         const double price = std::max(o.mid * (1 + deviation), 1 / scale);
+         const int64_t base = size(rng) * int64_t(scale);
+         const int64_t quote = std::max<int64_t>(std::llround(base * price), 1);
+         a.name = "order";
+         a.ids.push_back(next_id);
+         if(unit(rng) < 0.5) {
+            a.sell = Asset{base, precision, o.base};
+            a.buy = Asset{quote, precision, o.quote};
+         }
+         else {
+            a.sell = Asset{quote, precision, o.quote};
+            a.buy = Asset{base, precision, o.base};
+         }
+         placed[owner].push_back(next_id++);
+      }
+      flow.push_back(a);
+   }
+   return flow;
+}
+
+struct Stats {
+   std::vector<double> us;
+   uint64_t over_limit = 0;
+};
+
+double percentile(std::vector<double>& v, const double p) {
+   if(v.empty())
+      return 0;
+   const size_t i = std::min(v.size() - 1, size_t(p / 100 * v.size()));
+   std::nth_element(v.begin(), v.begin() + i, v.end());
+   return v[i];
+}
+
+}
+
+int main(int argc, char** argv) {
+   const Options o = parse_options(argc, argv);
+   const std::vector<Action> flow = o.log.empty() ? generate(o) : read_log(o.log);
+   if(!o.write.empty())
+      write_log(o.write, flow);
+
+   // fees of addtoken 0.1/0.2, the tick size of a new pair
+   Match_terms terms;
+   terms.tick_size = DEFAULT_TICK_SIZE;
+   terms.taker_fee = fee_rate(0.2);
+   terms.maker_fee = fee_rate(0.1);
+   terms.maker_min_order = 0;
+
+   uint8_t base_precision = 4, quote_precision = 4;
+   for(const Action& a: flow)
+      if(a.name == "order") {
+         base_precision = a.sell.symbol == o.base ? a.sell.precision : a.buy.precision;
+         quote_precision = a.sell.symbol == o.base ? a.buy.precision : a.sell.precision;
+         break;
+      }
+   Memory_market market(terms, base_precision, quote_precision);
+
+   std::map<uint64_t, uint64_t> replayed_ids;                // recorded id -> id in the market
+   std::map<std::string, std::set<uint64_t>> owner_orders;   // of the market
+   std::map<std::string, Stats> stats;
+   std::vector<std::pair<uint64_t, size_t>> depth;
+   uint64_t next_sample = 0, skipped = 0;
+
+   typedef std::chrono::steady_clock clock;
+   const auto start = clock::now();
+
+   for(size_t i = 0; i < flow.size(); i++) {
+      const Action& a = flow[i];
+      while(a.ms >= next_sample) {
+         depth.emplace_back(next_sample, market.depth());
+         next_sample += o.depth_every_ms;
+      }
+      if(o.target_rate > 0)
+         std::this_thread::sleep_until(start + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(i / o.target_rate)));
+
+      const auto before = clock::now();
+      if(a.name == "order") {
+         if(a.sell.symbol != o.base && a.sell.symbol != o.quote) {
+            skipped++;
+            continue;
+         }
+         const bool sell_side = a.sell.symbol == o.base;
+         const Asset& base = sell_side ? a.sell : a.buy;
+         const Asset& quote = sell_side ? a.buy : a.sell;
+         const price128_t ticks = to_ticks(quote.amount, base.amount, terms.tick_size);
+         // rejected by the contract without taking an id
+         if(!ticks_in_range(ticks)) {
+            skipped++;
+            continue;
+         }
+         const uint64_t id = market.place(sell_side ? SIDE_SELL : SIDE_BUY, uint64_t(ticks), a.sell.amount);
+         replayed_ids[a.ids[0]] = id;
+         if(market.resting(id))
+            owner_orders[a.owner].insert(id);
+      }
+      else if(a.name == "droporders") {
+         auto& own = owner_orders[a.owner];
+         for(uint64_t recorded: a.ids) {
+            auto itr = replayed_ids.find(recorded);
+            if(itr == replayed_ids.end())
+               continue;
+            market.cancel(itr->second);
+            own.erase(itr->second);
+         }
+      }
+      else if(a.name == "dropall") {
+         auto& own = owner_orders[a.owner];
+         for(uint64_t id: own)
+            market.cancel(id);
+         own.clear();
+      }
+      // transfers only move balances, which the in-memory book does not keep
+
+      const double us = std::chrono::duration<double, std::micro>(clock::now() - before).count();
+      Stats& s = stats[a.name];
+      s.us.push_back(us);
+      if(us > o.cpu_limit_us)
+         s.over_limit++;
+   }
+
+   const double seconds = std::chrono::duration<double>(clock::now() - start).count();
+   depth.emplace_back(next_sample, market.depth());
+
+   std::printf("actions %zu in %.3f s, %.0f actions/s, fills %llu, skipped %llu\n",
+               flow.size(), seconds, flow.size() / seconds, (unsigned long long)market.fills, (unsigned long long)skipped);
+   std::printf("%-12s %10s %10s %10s %10s %10s %12s\n", "action", "count", "p50_us", "p90_us", "p99_us", "max_us", "over_limit");
+   for(auto& s: stats)
+      std::printf("%-12s %10zu %10.2f %10.2f %10.2f %10.2f %12llu\n", s.first.c_str(), s.second.us.size(),
+                  percentile(s.second.us, 50), percentile(s.second.us, 90), percentile(s.second.us, 99),
+                  percentile(s.second.us, 100), (unsigned long long)s.second.over_limit);
+
+   size_t max_depth = 0;
+   for(auto& d: depth)
+      max_depth = std::max(max_depth, d.second);
+   std::printf("book depth: final %zu, max %zu over %zu samples\n", market.depth(), max_depth, depth.size());
+
+   if(!o.depth_out.empty()) {
+      std::ofstream file(o.depth_out);
+      file << "ms,depth\n";
+      for(auto& d: depth)
+         file << d.first << ',' << d.second << '\n';
+   }
+   return 0;
+}
@@ -0,0 +1,92 @@
+#include <memory_market.hpp>
+
+#include <cstdio>
+
+// match_orders over Memory_market, run by ctest
+
+namespace {
+
+int failures = 0;
+
+#define EXPECT(cond)                                                        \
+   do {                                                                     \
+      if(!(cond)) {                                                         \
+         std::fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+         failures++;                                                        \
+      }                                                                     \
+   } while(0)
+
+Match_terms terms() {
+   Match_terms t;
+   t.tick_size = DEFAULT_TICK_SIZE;
+   t.taker_fee = 0;
+   t.maker_fee = 0;
+   t.maker_min_order = 0;
+   return t;
+}
+
+// an ask and a bid at the same non-terminating price get the same ticks and cross
+void mirror_orders_cross() {
+   const price128_t ask = to_ticks(1, 3, DEFAULT_TICK_SIZE);
+   const price128_t bid = to_ticks(1, 3, DEFAULT_TICK_SIZE);
+   EXPECT(ask == bid);
+   EXPECT(ask == 333333333333ULL);
+   EXPECT(to_ticks(2, 3, DEFAULT_TICK_SIZE) == 666666666667ULL);
+
+   Memory_market market(terms());
+   market.place(SIDE_SELL, uint64_t(ask), 3000);
+   market.place(SIDE_BUY, uint64_t(bid), 1000);
+   EXPECT(market.fills == 1);
+   EXPECT(market.depth() == 0);
+}
+
+void ticks_out_of_range() {
+   EXPECT(!ticks_in_range(to_ticks(1, 3 * PRICE_SCALE, DEFAULT_TICK_SIZE)));
+   EXPECT(!ticks_in_range(to_ticks(INT64_MAX, 1, DEFAULT_TICK_SIZE)));
+   EXPECT(ticks_in_range(to_ticks(INT64_MAX, 1, PRICE_SCALE)));
+}
+
+// a buyer left with less quote than one unit costs stops and the maker keeps the rest
+void buyer_exhausted() {
+   const uint64_t three = 3 * PRICE_SCALE;
+   Memory_market market(terms());
+   const uint64_t maker = market.place(SIDE_SELL, three, 10);
+
+   int64_t left = 4;
+   uint32_t fills_left = UINT32_MAX;
+   EXPECT(match_orders(market, terms(), SIDE_BUY, three, left, fills_left) == MATCH_EXHAUSTED);
+   EXPECT(left == 1);
+   EXPECT(market.fills == 1);
+   EXPECT(market.resting(maker));
+}
+
+// the taker stops with prices still crossing when fills_left runs out
+void fill_limit() {
+   Memory_market market(terms());
+   for(int i = 0; i < 3; i++)
+      market.place(SIDE_SELL, PRICE_SCALE, 1);
+
+   int64_t left = 3;
+   uint32_t fills_left = 2;
+   EXPECT(match_orders(market, terms(), SIDE_BUY, PRICE_SCALE, left, fills_left) == MATCH_FILL_LIMIT);
+   EXPECT(left == 1);
+   EXPECT(fills_left == 0);
+   EXPECT(market.depth() == 1);
+
+   fills_left = 1;
+   EXPECT(match_orders(market, terms(), SIDE_BUY, PRICE_SCALE, left, fills_left) == MATCH_DONE);
+   EXPECT(left == 0);
+   EXPECT(market.depth() == 0);
+}
+
+}
+
+int main() {
+   mirror_orders_cross();
+   ticks_out_of_range();
+   buyer_exhausted();
+   fill_limit();
+   if(failures)
+      std::fprintf(stderr, "%d failed\n", failures);
+   return failures ? 1 : 0;
+}
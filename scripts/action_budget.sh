@@ -0,0 +1,298 @@
+#!/usr/bin/env bash
+set -eo pipefail
+
+# Deploys dexchange to a local single-producer test chain, drives the heavy workloads
+# (deep book, sweep, mass cancel, deltoken with many accounts) and checks the billed CPU
+# and RAM of each action against scripts/action_budget.conf.
+#
+# With -n the script starts its own chain: nodeos and keosd from PATH (or -N DIR) run on
+# fresh data and wallet directories under a temporary directory, eosio produces with the
+# development key, and both are stopped on exit. For example:
+#    scripts/action_budget.sh -n -t ~/eosio.contracts/build/contracts/eosio.token
+#
+# Without -n the node at -u is expected to be fresh, without the system contract, with the
+# key of eosio (-k) in an unlocked wallet of the default keosd.
+#
+# The budgets are recorded on the reference machine with -r and committed. An action with
+# no recorded budget is only checked against the 30 ms transaction limit.
+
+SCRIPT_DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )"
+
+function usage() {
+   printf "Usage: $0 OPTION...
+  -n          Start a fresh local node and wallet for the run, see above.
+  -N DIR      Directory with nodeos and keosd for -n. (Default: from PATH)
+  -u URL      Node API endpoint. (Default: http://127.0.0.1:8888)
+  -d DIR      Directory with dexchange.wasm and dexchange.abi. (Default: build/contracts/dexchange)
+  -t DIR      Directory with eosio.token.wasm and eosio.token.abi.
+  -k KEY      Public key of eosio in the wallet, used for the new accounts. (Default: development key)
+  -b FILE     Budget file. (Default: scripts/action_budget.conf)
+  -D N        Orders in the deep book. (Default: 200)
+  -S N        Makers taken by the sweep. (Default: 50)
+  -A N        Accounts holding the deleted token. (Default: 50)
+  -r          Record: write the measured values with 50%% headroom to the budget file.
+  -h          Print this help menu.
+   \\n" "$0" 1>&2
+   exit 1
+}
+
+URL=http://127.0.0.1:8888
+CONTRACT_DIR=build/contracts/dexchange
+TOKEN_DIR=
+KEY=EOS6MRyAjQq8ud7hVNYcfnVPJqcVpscN5So8BhtHuGYqET5GDW5CV
+BUDGET_FILE=$SCRIPT_DIR/action_budget.conf
+DEPTH=200
+SWEEP=50
+ACCOUNTS=50
+RECORD=false
+START_NODE=false
+NODE_BIN_DIR=
+WALLET_URL=
+
+while getopts "nN:u:d:t:k:b:D:S:A:rh" opt; do
+  case "${opt}" in
+    n ) START_NODE=true ;;
+    N ) NODE_BIN_DIR=$OPTARG ;;
+    u ) URL=$OPTARG ;;
+    d ) CONTRACT_DIR=$OPTARG ;;
+    t ) TOKEN_DIR=$OPTARG ;;
+    k ) KEY=$OPTARG ;;
+    b ) BUDGET_FILE=$OPTARG ;;
+    D ) DEPTH=$OPTARG ;;
+    S ) SWEEP=$OPTARG ;;
+    A ) ACCOUNTS=$OPTARG ;;
+    r ) RECORD=true ;;
+    * ) usage ;;
+  esac
+done
+
+[[ -z $TOKEN_DIR ]] && usage
+command -v cleos >/dev/null || { echo "cleos not found" 1>&2; exit 1; }
+command -v jq >/dev/null || { echo "jq not found" 1>&2; exit 1; }
+
+DEX=dexchange
+TOKEN=perf.token
+MAKER=perf.maker
+BIDDER=perf.bidder
+TAKER=perf.taker
+BASE=PBASE
+QUOTE=PQUOTE
+
+# CPU of an action without a recorded budget, the default 30 ms transaction limit
+CPU_CEILING=30000
+
+# measured actions, in the order of the budget file
+LABELS="transfer order_rest order_sweep dropall deltoken continuejob"
+
+declare -A CPU
+declare -A RAM
+declare -A FAILED
+
+function cleos-url() {
+  cleos -u $URL ${WALLET_URL:+--wallet-url $WALLET_URL} "$@"
+}
+
+# the well known development key pair of eosio
+DEV_PUBLIC_KEY=EOS6MRyAjQq8ud7hVNYcfnVPJqcVpscN5So8BhtHuGYqET5GDW5CV
+DEV_PRIVATE_KEY=5KQwrPbwdL6PhXujxW37FSSQZ1JiwsST4cqQzDeyXtP79zkvFD3
+
+# nodeos and keosd on fresh directories, stopped on exit
+function start-node() {
+  local bin=${NODE_BIN_DIR:+$NODE_BIN_DIR/} port=${URL##*:} i
+  NODE_DIR=$(mktemp -d)
+  trap "kill \$(jobs -p) 2>/dev/null; wait; rm -rf $NODE_DIR" EXIT
+
+  ${bin}keosd --wallet-dir $NODE_DIR/wallet --unlock-timeout 999999 \
+    --http-server-address 127.0.0.1:$(( port + 12 )) > $NODE_DIR/keosd.log 2>&1 &
+  WALLET_URL=http://127.0.0.1:$(( port + 12 ))
+
+  ${bin}nodeos -e -p eosio --data-dir $NODE_DIR/data --config-dir $NODE_DIR/config \
+    --plugin eosio::producer_plugin --plugin eosio::chain_api_plugin --plugin eosio::http_plugin \
+    --http-server-address 127.0.0.1:$port --signature-provider $DEV_PUBLIC_KEY=KEY:$DEV_PRIVATE_KEY \
+    --max-transaction-time 1000 --contracts-console > $NODE_DIR/nodeos.log 2>&1 &
+
+  for (( i = 0; i < 30; i++ )); do
+    if cleos-url get info >/dev/null 2>&1 && cleos-url wallet list >/dev/null 2>&1; then
+      break
+    fi
+    sleep 1
+  done
+  cleos-url wallet create --to-console >/dev/null
+  cleos-url wallet import --private-key $DEV_PRIVATE_KEY >/dev/null
+  KEY=$DEV_PUBLIC_KEY
+}
+
+# perfaaa, perfaab, ...
+function account-name() {
+  local i=$1 letters=abcdefghijklmnopqrstuvwxyz
+  printf "perf%s%s%s" ${letters:$(( i / 676 % 26 )):1} ${letters:$(( i / 26 % 26 )):1} ${letters:$(( i % 26 )):1}
+}
+
+function create-account() {
+  cleos-url create account eosio $1 $KEY $KEY >/dev/null
+}
+
+function push() {
+  cleos-url push action "$@" -j 2>/dev/null
+}
+
+# amount with 4 decimals, $1 is in ten thousandths
+function amount() {
+  printf "%d.%04d" $(( $1 / 10000 )) $(( $1 % 10000 ))
+}
+
+# pushes the action and keeps the largest CPU and RAM seen for the label,
+# an action that fails (e.g. on the CPU limit) always breaks the budget
+function measure() {
+  local label=$1 out cpu ram
+  shift
+  if ! out=$(push "$@"); then
+    FAILED[$label]=1
+    return
+  fi
+  cpu=$(jq '.processed.receipt.cpu_usage_us' <<< "$out")
+  ram=$(jq '[.processed.action_traces[] | .. | .account_ram_deltas? // empty | .[] | select(.account == "'$DEX'") | .delta] | add // 0' <<< "$out")
+
+  if [[ -z ${CPU[$label]} || $cpu -gt ${CPU[$label]} ]]; then
+    CPU[$label]=$cpu
+  fi
+  if [[ -z ${RAM[$label]} || $ram -gt ${RAM[$label]} ]]; then
+    RAM[$label]=$ram
+  fi
+}
+
+function setup() {
+  for a in $DEX $TOKEN $MAKER $BIDDER $TAKER; do
+    create-account $a
+  done
+  cleos-url set contract $DEX $CONTRACT_DIR dexchange.wasm dexchange.abi >/dev/null
+  cleos-url set contract $TOKEN $TOKEN_DIR eosio.token.wasm eosio.token.abi >/dev/null
+  cleos-url set account permission $DEX active --add-code >/dev/null
+
+  for s in $BASE $QUOTE; do
+    push $TOKEN create "[\"$TOKEN\", \"1000000000.0000 $s\"]" -p $TOKEN >/dev/null
+    push $TOKEN issue "[\"$TOKEN\", \"1000000000.0000 $s\", \"\"]" -p $TOKEN >/dev/null
+  done
+
+  push $DEX init '[]' -p $DEX >/dev/null
+  push $DEX addtoken "[\"$TOKEN\", \"4,$BASE\", 0.1, 0.2]" -p $DEX >/dev/null
+  push $DEX addtoken "[\"$TOKEN\", \"4,$QUOTE\", 0.1, 0.2]" -p $DEX >/dev/null
+  push $DEX addtokenpair "[\"0.0000 $BASE\", \"0.0000 $QUOTE\"]" -p $DEX >/dev/null
+
+  for a in $MAKER $BIDDER $TAKER; do
+    for s in $BASE $QUOTE; do
+      push $TOKEN transfer "[\"$TOKEN\", \"$a\", \"1000000.0000 $s\", \"\"]" -p $TOKEN >/dev/null
+    done
+    measure transfer $TOKEN transfer "[\"$a\", \"$DEX\", \"100000.0000 $BASE\", \"\"]" -p $a
+    measure transfer $TOKEN transfer "[\"$a\", \"$DEX\", \"100000.0000 $QUOTE\", \"\"]" -p $a
+  done
+}
+
+# bids of the minimum order one step apart below 1.0, the last one is placed into a book DEPTH orders deep
+function deep-book() {
+  for (( i = 1; i <= DEPTH; i++ )); do
+    measure order_rest $DEX order "[\"$BIDDER\", \"$(amount $(( 100000 - i ))) $QUOTE\", \"10.0000 $BASE\"]" -p $BIDDER
+  done
+}
+
+# SWEEP asks at 1.0 taken by a single buy order
+function sweep() {
+  for (( i = 0; i < SWEEP; i++ )); do
+    push $DEX order "[\"$MAKER\", \"1.0000 $BASE\", \"1.0000 $QUOTE\"]" -p $MAKER >/dev/null
+  done
+  measure order_sweep $DEX order "[\"$TAKER\", \"$SWEEP.0000 $QUOTE\", \"$SWEEP.0000 $BASE\"]" -p $TAKER
+}
+
+# a batch with a negative amount must be rejected, it would corrupt the price and the lock
+function negative-batch() {
+  local orders="[{\"sell\": \"10.0000 $BASE\", \"buy\": \"10.0000 $QUOTE\", \"type\": 0},
+                  {\"sell\": \"-1.0000 $BASE\", \"buy\": \"1.0000 $QUOTE\", \"type\": 0}]"
+  if push $DEX placebatch "[\"$MAKER\", $orders]" -p $MAKER >/dev/null; then
+    echo "placebatch accepted a negative amount" 1>&2
+    exit 1
+  fi
+}
+
+function mass-cancel() {
+  measure dropall $DEX dropall "[\"$BIDDER\"]" -p $BIDDER
+}
+
+# ACCOUNTS holders of the quote token, removed by deltoken and continuejob
+function delete-token() {
+  for (( i = 0; i < ACCOUNTS; i++ )); do
+    local a=$(account-name $i)
+    create-account $a
+    push $TOKEN transfer "[\"$TOKEN\", \"$a\", \"10.0000 $QUOTE\", \"\"]" -p $TOKEN >/dev/null
+    push $TOKEN transfer "[\"$a\", \"$DEX\", \"10.0000 $QUOTE\", \"\"]" -p $a >/dev/null
+  done
+
+  measure deltoken $DEX deltoken "[\"$TOKEN\", \"4,$QUOTE\"]" -p $DEX
+  for (( i = 0; i < ACCOUNTS; i += 10 )); do
+    measure continuejob $DEX continuejob '[10]' -p $DEX
+    if [[ $(cleos-url get table $DEX $DEX jobs | jq '.rows | length') -eq 0 ]]; then
+      break
+    fi
+  done
+}
+
+function check-budget() {
+  local failed=0 label cpu ram
+  declare -A BUDGET_CPU BUDGET_RAM
+  while read -r label cpu ram; do
+    [[ -z $label || $label == \#* ]] && continue
+    BUDGET_CPU[$label]=$cpu
+    BUDGET_RAM[$label]=$ram
+  done < $BUDGET_FILE
+
+  printf "%-14s %10s %10s %10s %10s\n" action cpu_us budget ram_bytes budget
+  for label in $LABELS; do
+    # without a recorded budget only the transaction limit holds
+    cpu=${BUDGET_CPU[$label]:-$CPU_CEILING}
+    ram=${BUDGET_RAM[$label]:--}
+    printf "%-14s %10s %10s %10s %10s" $label ${CPU[$label]:--} $cpu ${RAM[$label]:--} $ram
+    if [[ -n ${FAILED[$label]} ]]; then
+      printf "  FAILED"
+      failed=1
+    elif [[ -z ${CPU[$label]} ]]; then
+      printf "  NOT RUN"
+      failed=1
+    elif [[ ${CPU[$label]} -gt $cpu || ( $ram != - && ${RAM[$label]} -gt $ram ) ]]; then
+      printf "  OVER BUDGET"
+      failed=1
+    fi
+    printf "\n"
+  done
+  return $failed
+}
+
+function record-budget() {
+  for label in "${!FAILED[@]}"; do
+    echo "$label failed, the budget is not written" 1>&2
+    return 1
+  done
+  {
+    echo "# action       cpu_us  ram_bytes, written by action_budget.sh -r"
+    for label in $LABELS; do
+      printf "%-14s %7d %10d\n" $label $(( CPU[$label] * 3 / 2 )) $(( RAM[$label] > 0 ? RAM[$label] * 3 / 2 : 0 ))
+    done
+  } > $BUDGET_FILE
+  echo "budget written to $BUDGET_FILE"
+}
+
+if $START_NODE; then
+  start-node
+fi
+cleos-url get info >/dev/null
+
+setup
+negative-batch
+deep-book
+sweep
+mass-cancel
+delete-token
+
+if $RECORD; then
+  record-budget
+else
+  check-budget
+fi
@@ -0,0 +1,206 @@
+#!/usr/bin/env bash
+set -eo pipefail
+
+# Replays an order flow log (see native/replay/replay.cpp for the format, `replay --write`
+# generates a synthetic one) against a node at a target rate and reports throughput,
+# percentile CPU per action, book depth over time and the transactions that failed on
+# the CPU limit.
+#
+# dexchange is expected to be deployed with the pair of the log (e.g. by action_budget.sh)
+# and the key (-k) to be in an unlocked wallet. Owners of the log are created on the fly
+# and funded by the token contract account before their transfers.
+#
+# Order ids of the log are mapped to the ids the contract gives. Orders are pushed one at a
+# time and the id each one took is read back from the counters table, the replay stops when
+# the counter is not where the log order expects it. Transactions in flight (-j) apply to
+# the other actions.
+
+function usage() {
+   printf "Usage: $0 OPTION... LOG
+  -u URL      Node API endpoint. (Default: http://127.0.0.1:8888)
+  -a NAME     Contract account. (Default: dexchange)
+  -t NAME     Token contract account holding the issued supply. (Default: perf.token)
+  -k KEY      Public key for the new accounts. (Default: development key)
+  -r N        Target actions per second, 0 is as fast as possible. (Default: 0)
+  -j N        Transactions in flight, orders excluded. (Default: 1)
+  -D N        Book depth sample every N actions. (Default: 100)
+  -o FILE     Write the depth samples to FILE.
+  -h          Print this help menu.
+   \\n" "$0" 1>&2
+   exit 1
+}
+
+URL=http://127.0.0.1:8888
+DEX=dexchange
+TOKEN=perf.token
+KEY=EOS6MRyAjQq8ud7hVNYcfnVPJqcVpscN5So8BhtHuGYqET5GDW5CV
+RATE=0
+IN_FLIGHT=1
+DEPTH_EVERY=100
+DEPTH_OUT=
+
+while getopts "u:a:t:k:r:j:D:o:h" opt; do
+  case "${opt}" in
+    u ) URL=$OPTARG ;;
+    a ) DEX=$OPTARG ;;
+    t ) TOKEN=$OPTARG ;;
+    k ) KEY=$OPTARG ;;
+    r ) RATE=$OPTARG ;;
+    j ) IN_FLIGHT=$OPTARG ;;
+    D ) DEPTH_EVERY=$OPTARG ;;
+    o ) DEPTH_OUT=$OPTARG ;;
+    * ) usage ;;
+  esac
+done
+shift $(( OPTIND - 1 ))
+LOG=$1
+
+[[ -z $LOG || ! -f $LOG ]] && usage
+command -v cleos >/dev/null || { echo "cleos not found" 1>&2; exit 1; }
+command -v jq >/dev/null || { echo "jq not found" 1>&2; exit 1; }
+
+WORK_DIR=$(mktemp -d)
+trap "rm -rf $WORK_DIR" EXIT
+RESULTS=$WORK_DIR/results
+DEPTHS=$WORK_DIR/depths
+touch $RESULTS $DEPTHS
+
+declare -A CREATED
+declare -A IDS
+
+function cleos-url() {
+  cleos -u $URL "$@"
+}
+
+function now-ns() {
+  date +%s%N
+}
+
+# appends "<action> <cpu_us> <status>" to the results, status is ok, cpu or error.
+# pushed in the foreground it leaves the status in LAST_STATUS
+function push-measured() {
+  local label=$1 out status=ok cpu=-
+  shift
+  if out=$(cleos-url push action "$@" -j 2>&1); then
+    cpu=$(jq '.processed.receipt.cpu_usage_us' <<< "$out")
+  elif grep -qE "tx_cpu_usage_exceeded|deadline_exception|leeway_deadline_exception" <<< "$out"; then
+    status=cpu
+  else
+    status=error
+  fi
+  echo "$label $cpu $status" >> $RESULTS
+  LAST_STATUS=$status
+}
+
+function ensure-account() {
+  [[ -n ${CREATED[$1]} ]] && return
+  cleos-url create account eosio $1 $KEY $KEY >/dev/null 2>&1 || true
+  CREATED[$1]=1
+}
+
+function wait-in-flight() {
+  while (( $(jobs -rp | wc -l) >= IN_FLIGHT )); do
+    wait -n || true
+  done
+}
+
+function sample-depth() {
+  local depth
+  depth=$(cleos-url get table $DEX $DEX openorders -l 1000000 | jq '.rows | length')
+  echo "$(( ( $(now-ns) - START ) / 1000000 )) $depth" >> $DEPTHS
+}
+
+# id of the next order, counters is seeded from globalstate by the first order
+function order-counter() {
+  local next
+  next=$(cleos-url get table $DEX $DEX counters | jq -r '.rows[0].total_order_id // empty')
+  if [[ -z $next ]]; then
+    next=$(cleos-url get table $DEX $DEX globalstate | jq -r '.rows[0].total_order_id // 0')
+  fi
+  echo $next
+}
+
+NEXT_ID=$(order-counter)
+START=$(now-ns)
+COUNT=0
+
+while read -r ms action owner rest; do
+  [[ -z $ms || $ms == \#* ]] && continue
+
+  if [[ $RATE != 0 ]]; then
+    DUE=$(( START + COUNT * 1000000000 / RATE ))
+    NOW=$(now-ns)
+    (( DUE > NOW )) && sleep $(printf "0.%09d" $(( DUE - NOW )))
+  fi
+
+  ensure-account $owner
+  wait-in-flight
+
+  case $action in
+    transfer )
+      cleos-url push action $TOKEN transfer "[\"$TOKEN\", \"$owner\", \"$rest\", \"\"]" -p $TOKEN >/dev/null 2>&1 || true
+      push-measured transfer $TOKEN transfer "[\"$owner\", \"$DEX\", \"$rest\", \"\"]" -p $owner &
+    ;;
+    order )
+      read -r id sell_amount sell_symbol buy_amount buy_symbol <<< "$rest"
+      push-measured order $DEX order "[\"$owner\", \"$sell_amount $sell_symbol\", \"$buy_amount $buy_symbol\"]" -p $owner
+      # a failed order takes no id
+      if [[ $LAST_STATUS == ok ]]; then
+        IDS[$id]=$NEXT_ID
+        NEXT_ID=$(( NEXT_ID + 1 ))
+      fi
+      COUNTER=$(order-counter)
+      if (( COUNTER != NEXT_ID )); then
+        echo "order $id of the log: the contract counter is at $COUNTER, expected $NEXT_ID" 1>&2
+        exit 1
+      fi
+    ;;
+    droporders )
+      ids=
+      for id in $rest; do
+        if [[ -n ${IDS[$id]} ]]; then
+          ids="$ids${ids:+, }${IDS[$id]}"
+        fi
+      done
+      push-measured droporders $DEX droporders "[\"$owner\", [$ids]]" -p $owner &
+    ;;
+    dropall )
+      push-measured dropall $DEX dropall "[\"$owner\"]" -p $owner &
+    ;;
+  esac
+
+  COUNT=$(( COUNT + 1 ))
+  if (( COUNT % DEPTH_EVERY == 0 )); then
+    sample-depth
+  fi
+done < $LOG
+
+wait
+sample-depth
+ELAPSED_MS=$(( ( $(now-ns) - START ) / 1000000 ))
+
+printf "actions %d in %d ms, %d actions/s\n" $COUNT $ELAPSED_MS $(( COUNT * 1000 / (ELAPSED_MS > 0 ? ELAPSED_MS : 1) ))
+printf "%-12s %8s %8s %8s %8s %8s %8s %8s\n" action count p50_us p90_us p99_us max_us cpu_fail other_fail
+# percentile $1 of the sorted cpu file with n lines
+function pct() {
+  if (( n == 0 )); then
+    echo -
+  else
+    sed -n "$(( ( n * $1 + 99 ) / 100 > 0 ? ( n * $1 + 99 ) / 100 : 1 ))p" $WORK_DIR/cpu
+  fi
+}
+
+for action in $(cut -d' ' -f1 $RESULTS | sort -u); do
+  grep "^$action .* ok$" $RESULTS | cut -d' ' -f2 | sort -n > $WORK_DIR/cpu || true
+  n=$(wc -l < $WORK_DIR/cpu)
+  printf "%-12s %8d %8s %8s %8s %8s %8d %8d\n" $action $(grep -c "^$action " $RESULTS) \
+    $(pct 50) $(pct 90) $(pct 99) $(pct 100) \
+    $(grep -c "^$action .* cpu$" $RESULTS || true) $(grep -c "^$action .* error$" $RESULTS || true)
+done
+
+printf "book depth: final %s, max %s over %d samples\n" $(tail -1 $DEPTHS | cut -d' ' -f2) \
+  $(cut -d' ' -f2 $DEPTHS | sort -n | tail -1) $(wc -l < $DEPTHS)
+
+if [[ -n $DEPTH_OUT ]]; then
+  { echo "ms,depth"; tr ' ' ',' < $DEPTHS; } > $DEPTH_OUT
+fi